@@ -166,6 +166,15 @@ void getFrameQuality() {
   Serial.printf("Camera Quality is: %d\n", quality);
 }
 
+/** 
+ * @brief Applies the JPEG quality recommended by the RTSP server when the network slows down or recovers. 
+*/
+void onRateAdvice(const RTSP_RateAdvice& advice) {
+  sensor_t * s = esp_camera_sensor_get();
+  s->set_quality(s, advice.quality);
+  quality = advice.quality;
+}
+
 #ifdef HAVE_AUDIO
 /** 
  * @brief Sets up the I2S microphone. 
@@ -217,7 +226,9 @@ void sendVideo(void* pvParameters) {
     // Send frame via RTP
     if(rtspServer.readyToSendFrame()) {
       camera_fb_t* fb = esp_camera_fb_get();
-      rtspServer.sendRTSPFrame(fb->buf, fb->len, quality, fb->width, fb->height);
+      // Timestamp with the capture time (esp_timer clock) so players pace frames as captured
+      int64_t captureUs = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+      rtspServer.sendRTSPFrame(fb->buf, fb->len, captureUs);
       esp_camera_fb_return(fb);
     }
     vTaskDelay(pdMS_TO_TICKS(1)); 
@@ -343,6 +354,9 @@ void setup() {
 
   rtspServer.setCredentials(rtspUser, rtspPassword); // Set RTSP authentication
 
+  rtspServer.rateMinQuality = quality; // Best quality to go back to once the network keeps up
+  rtspServer.setRateCallback(onRateAdvice); // Lower the quality when the network falls behind
+
   // Initialize the RTSP server
   /**
    * @brief Initializes the RTSP server with the specified configuration.
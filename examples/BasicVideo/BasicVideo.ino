@@ -158,7 +158,9 @@ void sendVideo(void* pvParameters) {
     // Send frame via RTP
     if(rtspServer.readyToSendFrame()) {
       camera_fb_t* fb = esp_camera_fb_get();
-      rtspServer.sendRTSPFrame(fb->buf, fb->len, quality, fb->width, fb->height);
+      // Timestamp with the capture time (esp_timer clock) so players pace frames as captured
+      int64_t captureUs = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+      rtspServer.sendRTSPFrame(fb->buf, fb->len, captureUs);
       esp_camera_fb_return(fb);
     }
     vTaskDelay(pdMS_TO_TICKS(1)); 
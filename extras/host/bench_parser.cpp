@@ -0,0 +1,193 @@
+// RTSP request parsing: parseRTSPRequest() and parseTransport() against the strstr
+// scans over a copied request they replaced, on the OPTIONS, DESCRIBE, SETUP and
+// PLAY requests of VLC, ffmpeg and GStreamer as captured from each.
+// Both sides are timed best of five, alternating, as the host is shared. glibc's
+// strstr and memchr are vectorised where newlib's on the ESP32 are byte loops, so
+// the board differs. The parser also splits every URL, the old code only OPTIONS'.
+#include "host.h"
+#include <cctype>
+#include <string>
+
+struct Capture {
+  const char* client;
+  const char* request;
+  RTSP_Method method;
+  int cseq;
+  uint32_t sessionID;
+  uint16_t clientPort;  // SETUP only
+  int interleaved;  // SETUP only, -1 if none
+};
+
+static const Capture captures[] = {
+  {"VLC", "OPTIONS rtsp://192.168.1.50:554/ RTSP/1.0\r\n"
+          "CSeq: 2\r\n"
+          "User-Agent: LibVLC/3.0.20 (LIVE555 Streaming Media v2016.11.28)\r\n\r\n",
+   RTSP_METHOD_OPTIONS, 2, 0, 0, -1},
+  {"VLC", "DESCRIBE rtsp://192.168.1.50:554/ RTSP/1.0\r\n"
+          "CSeq: 3\r\n"
+          "User-Agent: LibVLC/3.0.20 (LIVE555 Streaming Media v2016.11.28)\r\n"
+          "Accept: application/sdp\r\n\r\n",
+   RTSP_METHOD_DESCRIBE, 3, 0, 0, -1},
+  {"VLC", "SETUP rtsp://192.168.1.50:554/video RTSP/1.0\r\n"
+          "CSeq: 4\r\n"
+          "User-Agent: LibVLC/3.0.20 (LIVE555 Streaming Media v2016.11.28)\r\n"
+          "Transport: RTP/AVP;unicast;client_port=56798-56799\r\n\r\n",
+   RTSP_METHOD_SETUP, 4, 0, 56798, -1},
+  {"VLC", "PLAY rtsp://192.168.1.50:554/ RTSP/1.0\r\n"
+          "CSeq: 6\r\n"
+          "User-Agent: LibVLC/3.0.20 (LIVE555 Streaming Media v2016.11.28)\r\n"
+          "Session: 1681692777\r\n"
+          "Range: npt=0.000-\r\n\r\n",
+   RTSP_METHOD_PLAY, 6, 1681692777, 0, -1},
+  {"ffmpeg", "OPTIONS rtsp://192.168.1.50:554/ RTSP/1.0\r\n"
+             "CSeq: 1\r\n"
+             "User-Agent: Lavf60.16.100\r\n\r\n",
+   RTSP_METHOD_OPTIONS, 1, 0, 0, -1},
+  {"ffmpeg", "DESCRIBE rtsp://192.168.1.50:554/ RTSP/1.0\r\n"
+             "Accept: application/sdp\r\n"
+             "CSeq: 2\r\n"
+             "User-Agent: Lavf60.16.100\r\n\r\n",
+   RTSP_METHOD_DESCRIBE, 2, 0, 0, -1},
+  {"ffmpeg", "SETUP rtsp://192.168.1.50:554/video RTSP/1.0\r\n"
+             "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n"
+             "CSeq: 3\r\n"
+             "User-Agent: Lavf60.16.100\r\n\r\n",
+   RTSP_METHOD_SETUP, 3, 0, 0, 0},
+  {"ffmpeg", "PLAY rtsp://192.168.1.50:554/ RTSP/1.0\r\n"
+             "Range: npt=0.000-\r\n"
+             "CSeq: 5\r\n"
+             "User-Agent: Lavf60.16.100\r\n"
+             "Session: 1681692777\r\n\r\n",
+   RTSP_METHOD_PLAY, 5, 1681692777, 0, -1},
+  {"GStreamer", "OPTIONS rtsp://192.168.1.50:554/ RTSP/1.0\r\n"
+                "CSeq: 1\r\n"
+                "User-Agent: GStreamer/1.22.0\r\n"
+                "Date: Sat, 17 Oct 2026 10:12:41 GMT\r\n\r\n",
+   RTSP_METHOD_OPTIONS, 1, 0, 0, -1},
+  {"GStreamer", "DESCRIBE rtsp://192.168.1.50:554/ RTSP/1.0\r\n"
+                "CSeq: 2\r\n"
+                "User-Agent: GStreamer/1.22.0\r\n"
+                "Accept: application/sdp\r\n"
+                "Date: Sat, 17 Oct 2026 10:12:41 GMT\r\n\r\n",
+   RTSP_METHOD_DESCRIBE, 2, 0, 0, -1},
+  {"GStreamer", "SETUP rtsp://192.168.1.50:554/video RTSP/1.0\r\n"
+                "CSeq: 3\r\n"
+                "Transport: RTP/AVP;unicast;client_port=40520-40521\r\n"
+                "User-Agent: GStreamer/1.22.0\r\n"
+                "Date: Sat, 17 Oct 2026 10:12:41 GMT\r\n\r\n",
+   RTSP_METHOD_SETUP, 3, 0, 40520, -1},
+  {"GStreamer", "PLAY rtsp://192.168.1.50:554/ RTSP/1.0\r\n"
+                "CSeq: 4\r\n"
+                "Range: npt=0-\r\n"
+                "User-Agent: GStreamer/1.22.0\r\n"
+                "Session: 1681692777\r\n"
+                "Date: Sat, 17 Oct 2026 10:12:41 GMT\r\n\r\n",
+   RTSP_METHOD_PLAY, 4, 1681692777, 0, -1},
+};
+
+static const char* methodName(RTSP_Method method) {
+  switch (method) {
+    case RTSP_METHOD_OPTIONS: return "OPTIONS";
+    case RTSP_METHOD_DESCRIBE: return "DESCRIBE";
+    case RTSP_METHOD_SETUP: return "SETUP";
+    case RTSP_METHOD_PLAY: return "PLAY";
+    default: return "?";
+  }
+}
+
+/**
+ * @brief What the handlers read before the single pass parser, as they read it:
+ *        from a NUL terminated copy in a buffer allocated per read, the end of the
+ *        headers and each field found with a strstr, the method with strncmp.
+ */
+static int parseStrstr(const char* data, size_t len) {
+  char* copy = (char*)ps_malloc(RTSP_BUFFER_SIZE);
+  memcpy(copy, data, len);
+  copy[len] = 0;
+  int fields = strstr(copy, "\r\n\r\n") != NULL;
+  size_t i = 0;
+  while (i < len && !isspace(copy[i])) i++;  // The base64 check
+  fields += i == len;
+  const char* cseq = strstr(copy, "CSeq: ");
+  if (cseq) fields += atoi(cseq + 6);
+  const char* session = strstr(copy, "Session: ");
+  if (session) fields += strtoul(session + 9, NULL, 10) != 0;
+  fields += strstr(copy, "Authorization: Basic ") != NULL;
+  fields += strncmp(copy, "GET / HTTP/", 10) == 0 || strncmp(copy, "POST / HTTP/", 11) == 0;
+  if (strncmp(copy, "OPTIONS", 7) == 0) {
+    const char* url = strstr(copy, "rtsp://");
+    if (url) {
+      const char* path = strchr(url + 7, '/');
+      fields += path && strchr(path, ' ');
+    }
+  } else if (strncmp(copy, "DESCRIBE", 8) == 0) {
+    fields++;
+  } else if (strncmp(copy, "SETUP", 5) == 0) {
+    fields += strstr(copy, "multicast") != NULL;
+    fields += strstr(copy, "RTP/AVP/TCP") != NULL || strstr(copy, "RTP/AVPF/TCP") != NULL;
+    fields += strstr(copy, "RTP/AVPF") != NULL;
+    fields += strstr(copy, "video") != NULL;
+    fields += strstr(copy, "audio") != NULL;
+    fields += strstr(copy, "subtitles") != NULL;
+    const char* interleaved = strstr(copy, "interleaved=");
+    if (interleaved) fields += atoi(interleaved + 12);
+    const char* clientPort = strstr(copy, "client_port=");
+    if (clientPort) fields += atoi(clientPort + 12);
+  }
+  free(copy);
+  return fields;
+}
+
+/**
+ * @brief Times two functions best of five benchNs() runs each, alternating so a
+ *        slow spell of the host does not fall on one side only.
+ */
+template <typename FnA, typename FnB>
+static void bestNs(FnA fnA, FnB fnB, double& nsA, double& nsB) {
+  nsA = nsB = 1e12;
+  for (int i = 0; i < 5; i++) {
+    double ns = benchNs(fnA);
+    if (ns < nsA) nsA = ns;
+    ns = benchNs(fnB);
+    if (ns < nsB) nsB = ns;
+  }
+}
+
+int main() {
+  RTSPServer server;
+  int failures = 0;
+
+  printf("%-10s %-9s %6s %12s %12s %8s\n", "client", "request", "bytes", "strstr ns", "single ns", "speedup");
+  for (const Capture& capture : captures) {
+    size_t len = strlen(capture.request);
+    RTSP_Request request;
+    RTSP_Transport transport = {};
+    int parsed = server.parseRTSPRequest(capture.request, len, request);
+    if (capture.method == RTSP_METHOD_SETUP) server.parseTransport(request.headers[RTSP_HEADER_TRANSPORT], transport);
+
+    bool ok = parsed == (int)len && request.method == capture.method && request.cseq == capture.cseq &&
+              request.sessionID == capture.sessionID;
+    if (capture.method == RTSP_METHOD_SETUP) {
+      ok = ok && server.spanEquals(request.track, "video") && transport.clientPort == capture.clientPort &&
+           transport.hasInterleaved == (capture.interleaved >= 0) &&
+           (!transport.hasInterleaved || transport.interleaved == capture.interleaved);
+    }
+    if (!ok) {
+      printf("%s %s was not parsed as expected\n", capture.client, methodName(capture.method));
+      failures++;
+    }
+
+    double strstrNs, singleNs;
+    bestNs([&] { keep(parseStrstr(capture.request, len)); },
+           [&] {
+             keep(server.parseRTSPRequest(capture.request, len, request));
+             if (request.method == RTSP_METHOD_SETUP) server.parseTransport(request.headers[RTSP_HEADER_TRANSPORT], transport);
+             keep(transport);
+           },
+           strstrNs, singleNs);
+    printf("%-10s %-9s %6zu %12.1f %12.1f %7.2fx\n", capture.client, methodName(capture.method), len, strstrNs, singleNs,
+           strstrNs / singleNs);
+  }
+  printf("All captures parsed as expected: %s\n", failures ? "NO" : "yes");
+  return failures ? 1 : 0;
+}
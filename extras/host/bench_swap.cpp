@@ -0,0 +1,39 @@
+// Byte swap of 16 bit PCM: the per-sample loop it replaced against swapSamples(),
+// on 1, 4 and 16 KB blocks. The ESP32-S3 PIE path only builds for that target,
+// run this there (or time it with esp_timer) for its numbers.
+#include "host.h"
+#include <vector>
+
+static void swapBytewise(int16_t* data, size_t samples) {
+  for (size_t i = 0; i < samples; i++) {
+    uint16_t s = (uint16_t)data[i];
+    data[i] = (int16_t)((s << 8) | (s >> 8));
+  }
+}
+
+int main() {
+  RTSPServer server;
+  int failures = 0;
+
+  // Every offset and length around the word and vector boundaries against the reference
+  for (size_t offset = 0; offset < 8; offset++) {
+    for (size_t samples = 0; samples < 80; samples++) {
+      alignas(16) int16_t expected[96], actual[96];
+      for (int i = 0; i < 96; i++) expected[i] = actual[i] = (int16_t)(0x0102 + i * 0x0101);
+      swapBytewise(expected + offset, samples);
+      server.swapSamples(actual + offset, samples);
+      if (memcmp(expected, actual, sizeof(expected)) != 0) failures++;
+    }
+  }
+  printf("swapSamples matches the bytewise swap: %s\n", failures ? "NO" : "yes");
+
+  printf("%8s %14s %14s %8s\n", "block", "bytewise ns", "swapSamples ns", "speedup");
+  for (size_t bytes : {1024, 4096, 16384}) {
+    std::vector<int16_t> block(bytes / 2);
+    for (size_t i = 0; i < block.size(); i++) block[i] = (int16_t)(i * 2654435761u);
+    double bytewise = benchNs([&] { swapBytewise(block.data(), block.size()); keep(block[0]); });
+    double wordwise = benchNs([&] { server.swapSamples(block.data(), block.size()); keep(block[0]); });
+    printf("%7zuK %14.1f %14.1f %7.2fx\n", bytes / 1024, bytewise, wordwise, bytewise / wordwise);
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,72 @@
+// ULPFEC parity: addFecPacket() with word-aligned and byte-aligned payloads (camera
+// buffers are only byte aligned) against a plain byte XOR of the same packets.
+#include "host.h"
+#include <vector>
+
+static void xorBytewise(uint8_t* dst, const uint8_t* src, size_t len) {
+  for (size_t i = 0; i < len; i++) dst[i] ^= src[i];
+}
+
+/**
+ * @brief Builds a full-size RTP/JPEG packet over payload, as sendRtpFrame() gets it.
+ */
+static RTP_Packet jpegPacket(const uint8_t* payload, uint16_t payloadLen, uint16_t sequenceNumber) {
+  RTP_Packet packet = {};
+  uint8_t* rtp = packet.header + RTP_TCP_PREFIX_SIZE;
+  rtp[0] = 0x80;
+  rtp[1] = 26;
+  rtp[4] = 0x12; // Timestamp
+  rtp[5] = 0x34;
+  for (int i = 0; i < RTP_JPEG_HEADER_SIZE; i++) rtp[RTP_HEADER_SIZE + i] = (uint8_t)(sequenceNumber * 7 + i);
+  packet.headerLen = RTP_TCP_PREFIX_SIZE + RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE;
+  packet.payload = payload;
+  packet.payloadLen = payloadLen;
+  return packet;
+}
+
+int main() {
+  RTSPServer server;
+  const uint16_t payloadLen = server.udpMaxPayload() - RTP_FEC_HEADER_SIZE - RTP_JPEG_HEADER_SIZE;
+  const int group = 5;
+  std::vector<uint8_t> frame(group * payloadLen + 4);
+  for (size_t i = 0; i < frame.size(); i++) frame[i] = (uint8_t)(i * 2654435761u >> 13);
+  int failures = 0;
+
+  printf("%10s %6s %16s %16s %8s\n", "payload", "bytes", "bytewise ns/pkt", "addFecPacket ns", "speedup");
+  for (size_t offset : {0, 1}) {
+    RTP_Packet packets[group];
+    for (int i = 0; i < group; i++) packets[i] = jpegPacket(frame.data() + offset + i * payloadLen, payloadLen, i);
+
+    // Parity of one group against the bytewise reference
+    std::vector<uint8_t> expected(RTP_JPEG_HEADER_SIZE + payloadLen, 0);
+    server.videoFec.count = 0;
+    for (int i = 0; i < group; i++) {
+      xorBytewise(expected.data(), packets[i].header + RTP_TCP_PREFIX_SIZE + RTP_HEADER_SIZE, RTP_JPEG_HEADER_SIZE);
+      xorBytewise(expected.data() + RTP_JPEG_HEADER_SIZE, packets[i].payload, payloadLen);
+      server.addFecPacket(packets[i], i, 0);
+    }
+    if (server.videoFec.protectionLength != expected.size() ||
+        memcmp(server.videoFec.payload, expected.data(), expected.size()) != 0) {
+      printf("parity of %s payloads differs from the bytewise XOR\n", offset ? "unaligned" : "aligned");
+      failures++;
+    }
+
+    int next = 0;
+    double bytewise = benchNs([&] {
+      xorBytewise(expected.data(), packets[next].header + RTP_TCP_PREFIX_SIZE + RTP_HEADER_SIZE, RTP_JPEG_HEADER_SIZE);
+      xorBytewise(expected.data() + RTP_JPEG_HEADER_SIZE, packets[next].payload, payloadLen);
+      next = (next + 1) % group;
+      keep(expected[0]);
+    });
+    next = 0;
+    double words = benchNs([&] {
+      if (next == 0) server.videoFec.count = 0;
+      server.addFecPacket(packets[next], next, 0);
+      next = (next + 1) % group;
+      keep(server.videoFec.payload[0]);
+    });
+    printf("%10s %6u %16.1f %16.1f %7.2fx\n", offset ? "unaligned" : "aligned", payloadLen, bytewise, words, bytewise / words);
+  }
+  printf("addFecPacket matches the bytewise XOR: %s\n", failures ? "NO" : "yes");
+  return failures ? 1 : 0;
+}
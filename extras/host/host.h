@@ -0,0 +1,33 @@
+// Shared helpers for the host benchmarks and tests.
+// The kernels under test are private members, so open the class up for these builds only.
+#pragma once
+#define private public
+#include "ESP32-RTSPServer.h"
+#undef private
+#include <chrono>
+#include <cstdio>
+
+/**
+ * @brief Runs fn repeatedly for about 200 ms and returns the mean time per call in nanoseconds.
+ */
+template <typename Fn>
+double benchNs(Fn fn) {
+  using Clock = std::chrono::steady_clock;
+  size_t calls = 0;
+  auto start = Clock::now();
+  auto elapsed = Clock::duration::zero();
+  do {
+    for (int i = 0; i < 64; i++) fn();
+    calls += 64;
+    elapsed = Clock::now() - start;
+  } while (elapsed < std::chrono::milliseconds(200));
+  return std::chrono::duration<double, std::nano>(elapsed).count() / calls;
+}
+
+/**
+ * @brief Keeps the compiler from optimising away a benchmarked result.
+ */
+template <typename T>
+inline void keep(const T& value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
@@ -0,0 +1,61 @@
+// Host stand-in for the Arduino core, just enough for the library to compile
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+typedef uint8_t byte;
+
+class String {
+public:
+  String() {}
+  String(const char*) {}
+  String(int) {}
+  const char* c_str() const { return ""; }
+  String operator+(const char*) const { return *this; }
+  String operator+(const String&) const { return *this; }
+};
+
+class IPAddress {
+public:
+  IPAddress() {}
+  IPAddress(uint8_t, uint8_t, uint8_t, uint8_t) {}
+  bool operator!=(const IPAddress&) const { return true; }
+  bool operator==(const IPAddress&) const { return true; }
+  String toString() const { return String(); }
+  operator uint32_t() const { return 0; }
+  uint8_t operator[](int) const { return 0; }
+};
+
+struct WiFiClass {
+  IPAddress localIP() { return IPAddress(); }
+  int RSSI() { return 0; }
+};
+extern WiFiClass WiFi;
+
+struct HardwareSerial {
+  operator bool() const { return true; }
+  int printf(const char*, ...) { return 0; }
+};
+extern HardwareSerial Serial;
+
+struct EspClass {
+  uint64_t getEfuseMac() { return 0; }
+};
+extern EspClass ESP;
+
+bool psramFound();
+void* ps_malloc(size_t size);
+uint32_t millis();
+uint32_t micros();
+uint32_t esp_random();
@@ -0,0 +1,9 @@
+// Host stand-in for esp_log
+#pragma once
+#define ESP_LOGI(tag, format, ...)
+#define ESP_LOGW(tag, format, ...)
+#define ESP_LOGE(tag, format, ...)
+#define ESP_LOGD(tag, format, ...)
+
+typedef enum { ESP_LOG_NONE, ESP_LOG_ERROR, ESP_LOG_WARN, ESP_LOG_INFO, ESP_LOG_DEBUG, ESP_LOG_VERBOSE } esp_log_level_t;
+void esp_log_level_set(const char* tag, esp_log_level_t level);
@@ -0,0 +1,5 @@
+// Host stand-in for libb64, the benchmarks and tests don't use Basic authentication
+#pragma once
+typedef struct { int step; } base64_decodestate;
+void base64_init_decodestate(base64_decodestate* state);
+int base64_decode_block(const char* code, int length, char* plain, base64_decodestate* state);
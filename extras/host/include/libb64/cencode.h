@@ -0,0 +1,5 @@
+// Host stand-in for libb64, the benchmarks and tests don't use Basic authentication
+#pragma once
+typedef struct { int step; } base64_encodestate;
+void base64_init_encodestate(base64_encodestate* state);
+int base64_encode_chars(const char* plain, int length, char* code);
@@ -0,0 +1,14 @@
+// Host stand-in for lwIP, the POSIX sockets API is close enough
+#pragma once
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define LWIP_SOCKET_OFFSET 0
+#ifndef CONFIG_LWIP_MAX_SOCKETS
+#define CONFIG_LWIP_MAX_SOCKETS 16
+#endif
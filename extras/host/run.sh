@@ -0,0 +1,23 @@
+#!/bin/sh
+# Builds the library for the host against the stand-ins in include/ and runs
+# every bench_*.cpp and test_*.cpp here. A test exits non zero on a mismatch.
+#   extras/host/run.sh             all of them
+#   extras/host/run.sh bench_swap  just one
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+src="$here/../../src"
+out="${TMPDIR:-/tmp}/rtsp-host"
+mkdir -p "$out"
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-"-O2 -std=gnu++17 -w"}
+
+if [ $# -gt 0 ]; then names="$*"; else
+  names=$(cd "$here" && ls bench_*.cpp test_*.cpp 2>/dev/null | sed 's/\.cpp$//')
+fi
+
+for name in $names; do
+  echo "== $name"
+  $CXX $CXXFLAGS -I"$here/include" -I"$src" -o "$out/$name" \
+    "$here/$name.cpp" "$here/stubs.cpp" "$src"/*.cpp
+  "$out/$name"
+done
@@ -0,0 +1,51 @@
+// Host implementations of the stand-ins in include/
+#include <time.h>
+#include "WiFi.h"
+#include "esp_log.h"
+#include "libb64/cencode.h"
+#include "libb64/cdecode.h"
+
+WiFiClass WiFi;
+HardwareSerial Serial;
+EspClass ESP;
+
+bool psramFound() { return false; }
+void* ps_malloc(size_t size) { return malloc(size); }
+uint32_t millis() { return (uint32_t)(esp_timer_get_time() / 1000); }
+uint32_t micros() { return (uint32_t)esp_timer_get_time(); }
+uint32_t esp_random() { return (uint32_t)rand(); }
+
+SemaphoreHandle_t xSemaphoreCreateMutex() { return (void*)1; }
+SemaphoreHandle_t xSemaphoreCreateBinary() { return (void*)1; }
+void vSemaphoreDelete(SemaphoreHandle_t) {}
+BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+BaseType_t xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+
+BaseType_t xTaskCreate(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, TaskHandle_t*) { return pdPASS; }
+void vTaskDelete(TaskHandle_t) {}
+void vTaskDelay(TickType_t) {}
+uint32_t ulTaskNotifyTake(BaseType_t, TickType_t) { return 0; }
+BaseType_t xTaskNotifyGive(TaskHandle_t) { return pdPASS; }
+void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t*) {}
+TaskHandle_t xTaskGetCurrentTaskHandle() { return NULL; }
+TickType_t xTaskGetTickCount() { return millis(); }
+void taskYIELD() {}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t*, esp_timer_handle_t*) { return ESP_OK; }
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t, uint64_t) { return ESP_OK; }
+esp_err_t esp_timer_start_once(esp_timer_handle_t, uint64_t) { return ESP_OK; }
+esp_err_t esp_timer_stop(esp_timer_handle_t) { return ESP_OK; }
+esp_err_t esp_timer_delete(esp_timer_handle_t) { return ESP_OK; }
+
+int64_t esp_timer_get_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void esp_log_level_set(const char*, esp_log_level_t) {}
+
+void base64_init_encodestate(base64_encodestate*) {}
+int base64_encode_chars(const char*, int, char*) { return 0; }
+void base64_init_decodestate(base64_decodestate*) {}
+int base64_decode_block(const char*, int, char*, base64_decodestate*) { return 0; }
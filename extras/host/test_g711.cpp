@@ -0,0 +1,62 @@
+// encodeG711() against the ITU-T G.191 reference encoders (alaw_compress and
+// ulaw_compress from the STL g711.c) on every 16 bit input.
+#include "host.h"
+
+static uint8_t alawCompress(int16_t linear) {
+  short ix = linear < 0 ? (~linear) >> 4 : linear >> 4;
+  if (ix > 15) {
+    short iexp = 1;
+    while (ix > 16 + 15) {
+      ix >>= 1;
+      iexp++;
+    }
+    ix -= 16;
+    ix += iexp << 4;
+  }
+  if (linear >= 0) ix |= 0x0080;
+  return (uint8_t)(ix ^ 0x0055);
+}
+
+static uint8_t ulawCompress(int16_t linear) {
+  short absno = linear < 0 ? ((~linear) >> 2) + 33 : (linear >> 2) + 33;
+  if (absno > 0x1FFF) absno = 0x1FFF;
+  short i = absno >> 6;
+  short segno = 1;
+  while (i != 0) {
+    segno++;
+    i >>= 1;
+  }
+  short highNibble = 0x0008 - segno;
+  short lowNibble = 0x000F - ((absno >> segno) & 0x000F);
+  short log = (highNibble << 4) | lowNibble;
+  if (linear >= 0) log |= 0x0080;
+  return (uint8_t)log;
+}
+
+int main() {
+  RTSPServer server;
+  static int16_t ulaw[65536], alaw[65536];
+  for (int i = 0; i < 65536; i++) ulaw[i] = alaw[i] = (int16_t)(i - 32768);
+
+  server.encodeG711(ulaw, 65536, false);
+  server.encodeG711(alaw, 65536, true);
+
+  // Encoded in place, byte i holds sample i
+  const uint8_t* ulawOut = reinterpret_cast<const uint8_t*>(ulaw);
+  const uint8_t* alawOut = reinterpret_cast<const uint8_t*>(alaw);
+  int ulawMismatches = 0, alawMismatches = 0;
+  for (int i = 0; i < 65536; i++) {
+    int16_t linear = (int16_t)(i - 32768);
+    if (ulawOut[i] != ulawCompress(linear)) {
+      if (!ulawMismatches) printf("first u-law mismatch at %d: %02x, expected %02x\n", linear, ulawOut[i], ulawCompress(linear));
+      ulawMismatches++;
+    }
+    if (alawOut[i] != alawCompress(linear)) {
+      if (!alawMismatches) printf("first A-law mismatch at %d: %02x, expected %02x\n", linear, alawOut[i], alawCompress(linear));
+      alawMismatches++;
+    }
+  }
+  printf("u-law: %d of 65536 inputs differ from G.191\n", ulawMismatches);
+  printf("A-law: %d of 65536 inputs differ from G.191\n", alawMismatches);
+  return ulawMismatches || alawMismatches ? 1 : 0;
+}
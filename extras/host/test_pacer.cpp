@@ -0,0 +1,142 @@
+// The token bucket behind frame pacing and maxSessionBitrate, driven by a virtual
+// clock: the bucket functions take the time as an argument and never read it.
+#include "host.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                          \
+  do {                                                       \
+    if (!(cond)) {                                           \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++;                                            \
+    }                                                        \
+  } while (0)
+
+/**
+ * @brief Starts full, empties, and allows the next send exactly when a token is back.
+ */
+static void testRefill() {
+  RTP_TokenBucket bucket;
+  int64_t now = 5000000;
+  tokenBucketStart(bucket, 1000000, 6000, now); // 1 byte per us
+  CHECK(tokenBucketDelay(bucket, now) == 0);
+  tokenBucketTake(bucket, 6000, now);
+  int64_t delay = tokenBucketDelay(bucket, now);
+  CHECK(delay > 0 && delay <= 3);
+  CHECK(tokenBucketDelay(bucket, now + delay) == 0);
+
+  // Idle time fills it up to the burst and no further
+  now += 1000000;
+  tokenBucketTake(bucket, 0, now);
+  CHECK(bucket.tokens == 6000);
+
+  // A clock read before the last update earns nothing
+  tokenBucketTake(bucket, 1000, now - 500);
+  CHECK(bucket.tokens == 5000);
+}
+
+/**
+ * @brief A send larger than the burst goes through and is paid back at the rate.
+ */
+static void testOversizedSend() {
+  RTP_TokenBucket bucket;
+  tokenBucketStart(bucket, 10000, 1000, 0); // 10 bytes per ms
+  tokenBucketTake(bucket, 5000, 0);
+  CHECK(bucket.tokens == -4000);
+  int64_t delay = tokenBucketDelay(bucket, 0);
+  CHECK(delay > 400000 && delay <= 400200); // 4001 bytes at 10 bytes per ms
+  CHECK(tokenBucketDelay(bucket, 399000) > 0);
+  CHECK(tokenBucketDelay(bucket, delay) == 0);
+}
+
+/**
+ * @brief No rate means no limit.
+ */
+static void testUnlimited() {
+  RTP_TokenBucket bucket;
+  tokenBucketStart(bucket, 0, 0, 0);
+  tokenBucketTake(bucket, 100000, 0);
+  CHECK(tokenBucketDelay(bucket, 0) == 0);
+}
+
+/**
+ * @brief Paces a 100 KB frame at 20 fps over half the frame interval, as
+ *        startFramePacing() and pacePacket() do.
+ */
+static void testFramePacing() {
+  const size_t packet = 1430;
+  const int packets = 70;
+  const uint32_t fps = 20;
+  const uint8_t percent = 50;
+  const int64_t windowUs = 1000000 / fps * percent / 100;
+  const uint32_t rate = framePacingRate(packet * packets, fps, percent);
+  CHECK(rate == packet * packets * 1000000 / windowUs);
+  CHECK(framePacingRate(packet * packets, fps, 0) == 0);
+  CHECK(framePacingRate(packet * packets, fps, 200) == framePacingRate(packet * packets, fps, 100));
+
+  RTP_TokenBucket bucket;
+  int64_t start = 1000000, now = start;
+  tokenBucketStart(bucket, rate, RTP_PACE_BURST, now);
+  size_t burstBytes = 0; // Sent before the first wait
+  int waits = 0;
+  for (int i = 0; i < packets; i++) {
+    int64_t delay = pacingDelay(bucket, now);
+    CHECK(delay == 0 || delay >= RTP_PACE_MIN_WAIT_US);
+    if (delay > 0) {
+      now += delay;
+      waits++;
+    }
+    if (waits == 0) burstBytes += packet;
+    tokenBucketTake(bucket, packet, now);
+  }
+
+  // Skipped short waits let the frame start up to RTP_PACE_MIN_WAIT_US worth
+  // over the burst and end that much sooner
+  int64_t tookUs = now - start;
+  int64_t earliestUs = (int64_t)(packet * (packets - 1) - RTP_PACE_BURST) * 1000000 / rate - RTP_PACE_MIN_WAIT_US;
+  printf("frame of %d packets paced over %lld us with %d waits, %zu bytes before the first\n", packets,
+         (long long)tookUs, waits, burstBytes);
+  CHECK(tookUs >= earliestUs && tookUs <= windowUs);
+  CHECK(burstBytes <= RTP_PACE_BURST + (size_t)rate * RTP_PACE_MIN_WAIT_US / 1000000 + packet);
+  CHECK(waits > 0);
+}
+
+/**
+ * @brief maxSessionBitrate: 20 KB frames at 20 fps (3.2 Mbit/s) capped at 1 Mbit/s.
+ *
+ * The bucket starts full with a second of traffic, as takeSessionBitrate() starts it,
+ * after that only the rate gets through.
+ */
+static void testBitrateCap() {
+  const uint32_t rate = 1000000 / 8;
+  const uint32_t burst = rate;
+  const size_t frame = 20000;
+  const int64_t frameUs = 50000;
+  RTP_TokenBucket bucket;
+  tokenBucketStart(bucket, rate, burst, 0);
+  size_t sent = 0, sentAfterBurst = 0;
+  for (int64_t now = 0; now < 10000000; now += frameUs) {
+    if (now == 2000000) sentAfterBurst = sent;
+    if (tokenBucketDelay(bucket, now) == 0) {
+      tokenBucketTake(bucket, frame, now);
+      sent += frame;
+    }
+  }
+  sentAfterBurst = sent - sentAfterBurst;
+  printf("bitrate cap of %u bytes/s let through %.0f bytes/s once the starting burst was used\n", rate,
+         sentAfterBurst / 8.0);
+  // A send may overdraw the bucket by less than a frame
+  CHECK(sent < burst + (size_t)rate * 10 + frame);
+  CHECK(sentAfterBurst < (size_t)rate * 8 + frame);
+  CHECK(sentAfterBurst + frame > (size_t)rate * 8);
+}
+
+int main() {
+  testRefill();
+  testOversizedSend();
+  testUnlimited();
+  testFramePacing();
+  testBitrateCap();
+  printf("token bucket: %d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -1,9 +1,11 @@
 #include "ESP32-RTSPServer.h"
+#include <new>
 
 const char* RTSPServer::LOG_TAG = "RTSPServer";
 
 RTSPServer::RTSPServer()
   : rtpFps(0),
+    rtpFramesSkipped(0),
     // User can change these settings
     transport(VIDEO_AND_SUBTITLES), // Default transport 
     sampleRate(0),
@@ -13,7 +15,19 @@ RTSPServer::RTSPServer()
     rtpVideoPort(5430),
     rtpAudioPort(5432),
     rtpSubtitlesPort(5434),
+    rtpFecPort(5436),
     maxRTSPClients(3),
+    rtpMtu(1500),
+    audioCodec(AUDIO_L16),
+    audioPtime(0),
+    fecGroupSize(0),
+    maxSessionFps(0),
+    maxSessionBitrate(0),
+    pacingPercent(0),
+    rateMinQuality(10),
+    rateMaxQuality(40),
+    tcpQueuePolicy(QUEUE_DROP_FRAME),
+    tcpSendDeadlineMs(2000),
     //
     rtspSocket(-1),
     videoUnicastSocket(-1),
@@ -22,10 +36,34 @@ RTSPServer::RTSPServer()
     videoMulticastSocket(-1),
     audioMulticastSocket(-1),
     subtitlesMulticastSocket(-1),
+    videoRtcpSocket(-1),
+    audioRtcpSocket(-1),
+    subtitlesRtcpSocket(-1),
     activeRTSPClients(0),
     maxClients(1),
     rtpVideoTaskHandle(NULL),
+    rtpAudioTaskHandle(NULL),
     rtspTaskHandle(NULL),
+    videoFrameNumber(0),
+    audioData(NULL),
+    audioLen(0),
+    audioSamples(0),
+    audioBlockNumber(0),
+    adpcmPredictor(0),
+    adpcmIndex(0),
+    audioFrameBuffer(NULL),
+    audioTaskStop(false),
+    audioMarker(true),
+    lastAudioCaptureUs(0),
+    audioClockDrift(0),
+    rateCallback(NULL),
+    rateCleanIntervals(0),
+    rateTcpWaits(0),
+    rateTcpWaitUs(0),
+    rateTcpDrops(0),
+    rateUdpErrors(0),
+    rateUdpSends(0),
+    lastRateUpdateTime(0),
     rtspStreamBuffer(NULL),
     rtspStreamBufferSize(0),
     rtpFrameSent(true),
@@ -34,17 +72,14 @@ RTSPServer::RTSPServer()
     vQuality(0),
     vWidth(0),
     vHeight(0),
-    videoSequenceNumber(0),
     videoTimestamp(0),
-    audioSequenceNumber(0),
     audioTimestamp(0),
-    subtitlesSequenceNumber(0),
     subtitlesTimestamp(0),
+    jpegQ(0),
+    qTablesPending(true),
+    lastQTablesTime(0),
     rtpFrameCount(0),
     lastRtpFPSUpdateTime(0),
-    videoCh(0),
-    audioCh(0),
-    subtitlesCh(0),
     isVideo(false),
     isAudio(false),
     isSubtitles(false),
@@ -54,9 +89,44 @@ RTSPServer::RTSPServer()
     firstClientIsTCP(false),
     authEnabled(false) // Initialize authEnabled to false
 {
-    isPlayingMutex = xSemaphoreCreateMutex(); // Initialize the mutex
+    for (int i = 0; i < RTP_PACKET_LISTS; i++) {
+      videoPacketLists[i].maxPayload = 0;
+      videoPacketLists[i].number = 0;
+      audioPacketLists[i].maxPayload = 0;
+      audioPacketLists[i].number = 0;
+    }
+    audioRing.buffer = NULL;
+    audioRing.size = 0;
+    audioRing.head = 0;
+    audioRing.tail = 0;
+    audioRing.headTime = 0;
+    memset(&videoFec, 0, sizeof(videoFec));
+    memset(&videoPacer, 0, sizeof(videoPacer));
+    pacing = false;
+    pacerTimer = NULL;
+    pacerSemaphore = NULL;
+    memset(recvBuffers, 0, sizeof(recvBuffers));
+    memset(egressQueues, 0, sizeof(egressQueues));
+    for (RTSP_EgressQueue& queue : egressQueues) {
+      queue.sock = -1;
+    }
+    for (RTSP_Session& session : sessions) {
+      session.inUse = false;
+      session.sock = -1;
+      session.isPlaying = false;
+      session.videoTrack.history = NULL;
+    }
+    for (RTSP_PlayingList& list : playingLists) {
+      list.count = 0;
+      list.readers = 0;
+    }
+    playingList = &playingLists[0];
+    videoMulticastTrack.history = NULL; // Multicast receivers do not NACK
+    audioMulticastTrack.history = NULL;
+    subtitlesMulticastTrack.history = NULL;
+    fecMulticastTrack.history = NULL;
+    memset(&rateAdvice, 0, sizeof(rateAdvice)); // Set by startRateControl
     sendTcpMutex = xSemaphoreCreateMutex(); // Initialize the mutex
-    maxClientsMutex = xSemaphoreCreateMutex();
 #ifdef RTSP_LOGGING_ENABLED
     esp_log_level_set(LOG_TAG, ESP_LOG_DEBUG); // Set log level to DEBUG
 #endif
@@ -65,9 +135,7 @@ RTSPServer::RTSPServer()
 RTSPServer::~RTSPServer() {
   // Clean up resources
   deinit();
-  vSemaphoreDelete(this->isPlayingMutex);
   vSemaphoreDelete(this->sendTcpMutex);
-  vSemaphoreDelete(this->maxClientsMutex);
 }
 
 bool RTSPServer::init(TransportType transport, uint16_t rtspPort, uint32_t sampleRate, uint16_t port1, uint16_t port2, uint16_t port3, IPAddress rtpIp, uint8_t rtpTTL) {
@@ -147,6 +215,7 @@ void RTSPServer::deinit() {
     vTaskDelete(this->rtpVideoTaskHandle);
     this->rtpVideoTaskHandle = NULL;
   }
+  stopAudioRing();
   if (this->rtspSocket >= 0) {
     close(this->rtspSocket);
     this->rtspSocket = -1;
@@ -157,6 +226,27 @@ void RTSPServer::deinit() {
   if (this->rtspStreamBuffer) {
     free(this->rtspStreamBuffer);
   }
+  free(this->videoFec.payload);
+  this->videoFec.payload = NULL;
+  if (this->pacerTimer != NULL) {
+    esp_timer_stop(this->pacerTimer);
+    esp_timer_delete(this->pacerTimer);
+    this->pacerTimer = NULL;
+    vSemaphoreDelete(this->pacerSemaphore);
+    this->pacerSemaphore = NULL;
+  }
+  this->pacing = false;
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    free(this->recvBuffers[i].data);
+    this->recvBuffers[i].data = NULL;
+    this->recvBuffers[i].len = 0;
+    this->recvBuffers[i].skipLen = 0;
+    free(this->egressQueues[i].buffer);
+    this->egressQueues[i].buffer = NULL;
+    this->egressQueues[i].len = 0;
+    this->egressQueues[i].remaining = 0;
+    this->egressQueues[i].sock = -1;
+  }
 
   RTSP_LOGI(LOG_TAG, "RTSP server deinitialized.");
 }
@@ -191,13 +281,37 @@ void RTSPServer::closeSockets() {
     close(subtitlesMulticastSocket);
     subtitlesMulticastSocket = -1;
   }
+  if (videoRtcpSocket != -1) {
+    close(videoRtcpSocket);
+    videoRtcpSocket = -1;
+  }
+  if (audioRtcpSocket != -1) {
+    close(audioRtcpSocket);
+    audioRtcpSocket = -1;
+  }
+  if (subtitlesRtcpSocket != -1) {
+    close(subtitlesRtcpSocket);
+    subtitlesRtcpSocket = -1;
+  }
 }
 
 bool RTSPServer::prepRTSP() {
   uint64_t mac = ESP.getEfuseMac();
-  this->videoSSRC = static_cast<uint32_t>(mac & 0xFFFFFFFF);
-  this->audioSSRC = static_cast<uint32_t>((mac >> 32) & 0xFFFFFFFF);
-  this->subtitlesSSRC = static_cast<uint32_t>((mac >> 48) & 0xFFFFFFFF);
+  startRateControl();
+  initTrackState(this->videoMulticastTrack, 0);
+  initTrackState(this->audioMulticastTrack, 0);
+  initTrackState(this->subtitlesMulticastTrack, 0);
+  initTrackState(this->fecMulticastTrack, 0);
+  this->fecMulticastTrack.timestampOffset = this->videoMulticastTrack.timestampOffset; // Parity is timestamped on the video clock
+  this->videoMulticastTrack.ssrc = static_cast<uint32_t>(mac & 0xFFFFFFFF);
+  this->audioMulticastTrack.ssrc = static_cast<uint32_t>((mac >> 32) & 0xFFFFFFFF);
+  this->subtitlesMulticastTrack.ssrc = static_cast<uint32_t>((mac >> 48) & 0xFFFFFFFF);
+  // Set once, the multicast tracks are shared by all multicast sessions
+  uint32_t multicastIp = multicastDestinationIp();
+  setTrackDestination(this->videoMulticastTrack, multicastIp, this->rtpVideoPort);
+  setTrackDestination(this->audioMulticastTrack, multicastIp, this->rtpAudioPort);
+  setTrackDestination(this->subtitlesMulticastTrack, multicastIp, this->rtpSubtitlesPort);
+  setTrackDestination(this->fecMulticastTrack, multicastIp, this->rtpFecPort);
 
   this->rtspSocket = socket(AF_INET, SOCK_STREAM, 0);
   if (this->rtspSocket < 0) {
@@ -249,29 +363,62 @@ void RTSPServer::rtspTask() {
   struct sockaddr_in clientAddr;
   socklen_t addr_len = sizeof(clientAddr);
   fd_set read_fds;
-  int client_sockets[MAX_CLIENTS] = {0};
+  fd_set write_fds;
   int max_sd, activity, client_sock;
 
   while (true) {
     FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
     FD_SET(this->rtspSocket, &read_fds);
     max_sd = this->rtspSocket;
+    bool queuesPending = false;
 
     uint8_t currentMaxClients = getMaxClients();
 
-    for (int i = 0; i < currentMaxClients; i++) {
-      int sd = client_sockets[i];
-      if (sd > 0) FD_SET(sd, &read_fds);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+      int sd = this->sessions[i].sock;
+      if (sd >= 0) FD_SET(sd, &read_fds);
       if (sd > max_sd) max_sd = sd;
+
+      // Wait for slow TCP clients to take their queued packets
+      const RTSP_EgressQueue& queue = this->egressQueues[i];
+      if (queue.len > 0 && queue.sock >= 0) {
+        FD_SET(queue.sock, &write_fds);
+        if (queue.sock > max_sd) max_sd = queue.sock;
+        queuesPending = true;
+      }
     }
 
-    activity = select(max_sd + 1, &read_fds, NULL, NULL, NULL);
+    // Receiver reports from UDP clients
+    int rtcpSockets[3] = { this->videoRtcpSocket, this->audioRtcpSocket, this->subtitlesRtcpSocket };
+    for (int i = 0; i < 3; i++) {
+      if (rtcpSockets[i] >= 0) FD_SET(rtcpSockets[i], &read_fds);
+      if (rtcpSockets[i] > max_sd) max_sd = rtcpSockets[i];
+    }
+
+    // Wake up to check the send deadline of queues whose clients stopped reading
+    struct timeval queueTimeout = { .tv_sec = 0, .tv_usec = 100000 };
+    activity = select(max_sd + 1, &read_fds, &write_fds, NULL, queuesPending ? &queueTimeout : NULL);
 
     if (activity < 0 && errno != EINTR) {
       RTSP_LOGE(LOG_TAG, "Select error");
       continue;
     }
 
+    if (queuesPending) {
+      for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (this->egressQueues[i].len > 0) {
+          serviceEgressQueue(this->egressQueues[i]);
+        }
+      }
+    }
+
+    for (int i = 0; i < 3; i++) {
+      if (rtcpSockets[i] >= 0 && FD_ISSET(rtcpSockets[i], &read_fds)) {
+        handleRtcpSocket(rtcpSockets[i]);
+      }
+    }
+
     if (FD_ISSET(this->rtspSocket, &read_fds)) {
       if (getActiveRTSPClients() >= currentMaxClients) {
         client_sock = accept(this->rtspSocket, (struct sockaddr *)&clientAddr, &addr_len);
@@ -301,10 +448,21 @@ void RTSPServer::rtspTask() {
 
       RTSP_LOGI(LOG_TAG, "New client connected");
 
-      // Create a new session for the new client
-      RTSP_Session session = {
-        esp_random(),  // sessionID
+      // Create a new session for the new client in a free slot
+      int slot = 0;
+      while (slot < MAX_CLIENTS && this->sessions[slot].inUse) {
+        slot++;
+      }
+      if (slot == MAX_CLIENTS) {
+        RTSP_LOGE(LOG_TAG, "No free session slot");
+        close(client_sock);
+        continue;
+      }
+      // Built in place, the tracks' RTCP stats hold an atomic so a session cannot be assigned
+      new (&this->sessions[slot]) RTSP_Session{
+        generateSessionID(slot),  // sessionID
         client_sock,   // sock
+        true,         // inUse
         0,            // cseq
         0,            // cVideoPort
         0,            // cAudioPort
@@ -314,48 +472,55 @@ void RTSPServer::rtspTask() {
         false,        // isTCP
         false,        // isHttp
         -1,           // httpSock
-        {0}           // sessionCookie (initialized as empty)
+        udpMaxPayload(), // maxPayload (set on SETUP)
+        udpMaxPayload(), // audioMaxPayload
+        0,            // maxFps
+        0,            // nextFrameTimestamp
+        {},           // bitrateBucket (started on the first frame)
+        {0},          // sessionCookie (initialized as empty)
+        0,            // cookieHash
+        {},           // videoTrack (initialized on SETUP)
+        {},           // audioTrack
+        {}            // subtitlesTrack
       };
-      sessions[session.sessionID] = session;
-
-      for (int i = 0; i < currentMaxClients; i++) {
-        if (client_sockets[i] == 0) {
-          client_sockets[i] = client_sock;
-          incrementActiveRTSPClients();
-          RTSP_LOGI(LOG_TAG, "Added to list of sockets as %d", i);
-          break;
-        }
+      incrementActiveRTSPClients();
+      RTSP_LOGI(LOG_TAG, "Added to list of sockets as %d", slot);
+
+      // Kept for the whole connection so requests can span reads
+      RTSP_RecvBuffer& recvBuffer = this->recvBuffers[slot];
+      if (recvBuffer.data == NULL) {
+        recvBuffer.data = (char*)(psramFound() ? ps_malloc(RTSP_BUFFER_SIZE) : malloc(RTSP_BUFFER_SIZE));
+      }
+      recvBuffer.len = 0;
+      recvBuffer.skipLen = 0;
+      recvBuffer.base64Len = 0;
+      if (recvBuffer.data == NULL) {
+        RTSP_LOGE(LOG_TAG, "Failed to allocate receive buffer");
       }
     }
 
-    for (int i = 0; i < currentMaxClients; i++) {
-      int sd = client_sockets[i];
-
-      if (FD_ISSET(sd, &read_fds)) {
-        // Get the session for this client
-        RTSP_Session* session = nullptr;
-        for (auto& sess : sessions) {
-          if (sess.second.sock == sd) {
-            session = &sess.second;
-            break;
-          }
-        }
-        if (session) {
-          bool keepConnection = handleRTSPRequest(*session);
-          if (!keepConnection) {
-            if (getActiveRTSPClients() == 1) {
-              setIsPlaying(false);
-              closeSockets();
-              RTSP_LOGD(LOG_TAG, "All clients disconnected. Resetting firstClientConnected flag."); 
-              this->firstClientConnected = false; 
-              this->firstClientIsMulticast = false; 
-              this->firstClientIsTCP = false; 
-            }
-            close(sd);
-            client_sockets[i] = 0;
-            sessions.erase(session->sessionID); // Remove session when client disconnects
-            decrementActiveRTSPClients();
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+      RTSP_Session& session = this->sessions[i];
+      int sd = session.sock;
+
+      if (sd >= 0 && FD_ISSET(sd, &read_fds)) {
+        bool keepConnection = handleRTSPRequest(session, this->recvBuffers[i]);
+        if (!keepConnection) {
+          session.isPlaying = false;
+          updateIsPlayingStatus(); // Returns once no sender uses the session
+          if (getActiveRTSPClients() == 1) {
+            setIsPlaying(false);
+            closeSockets();
+            RTSP_LOGD(LOG_TAG, "All clients disconnected. Resetting firstClientConnected flag."); 
+            this->firstClientConnected = false; 
+            this->firstClientIsMulticast = false; 
+            this->firstClientIsTCP = false; 
           }
+          close(sd);
+          this->recvBuffers[i].len = 0;
+          this->recvBuffers[i].skipLen = 0;
+          freeSession(session); // Remove session when client disconnects
+          decrementActiveRTSPClients();
         }
       }
     }
@@ -4,7 +4,8 @@
 #include <WiFi.h>
 #include "lwip/sockets.h"
 #include <esp_log.h>
-#include <map>
+#include <atomic>
+#include <vector>
 
 #define MAX_RTSP_BUFFER (512 * 1024)
 #define RTP_STACK_SIZE (1024 * 8)
@@ -12,6 +13,8 @@
 #define RTSP_STACK_SIZE (1024 * 8)
 #define RTSP_PRI 10
 #define MAX_CLIENTS 10 // max rtsp clients
+#define RTSP_SESSION_SLOT_MASK 0x0F // Low bits of a session ID hold its slot, so MAX_CLIENTS <= 16
+static_assert(MAX_CLIENTS <= RTSP_SESSION_SLOT_MASK + 1, "MAX_CLIENTS slots must fit in RTSP_SESSION_SLOT_MASK");
 
 #define RTSP_BUFFER_SIZE 8092
 
@@ -36,9 +39,207 @@
 
 #define MAX_COOKIE_LENGTH 128 // max length of session cookie
 
+#define RTP_TCP_PREFIX_SIZE 4 // '$', channel and 16 bit length for interleaved packets
+#define RTP_HEADER_SIZE 12
+#define RTP_JPEG_HEADER_SIZE 8
+#define RTP_JPEG_RESTART_HEADER_SIZE 4
+#define MAX_RTP_PACKET_HEADER (RTP_TCP_PREFIX_SIZE + RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE + RTP_JPEG_RESTART_HEADER_SIZE)
+
+#define RTP_JPEG_QTABLE_HEADER_SIZE 4
+#define RTP_DVI4_HEADER_SIZE 4 // Predicted value, step index and a reserved byte
+#define RTP_UDP_OVERHEAD 28 // IPv4 and UDP headers
+#define RTP_PACKET_LISTS 3 // Payload sizes packetized per frame: multicast with FEC, unicast UDP and TCP
+
+#define RTCP_PACKET_SIZE 128
+#ifndef RTCP_SR_INTERVAL_MS
+#define RTCP_SR_INTERVAL_MS 5000 // RFC 3550 minimum interval between sender reports
+#endif
+
+#define RTP_RTX_PAYLOAD_TYPE 99
+#ifndef RTSP_NACK_HISTORY
+#define RTSP_NACK_HISTORY 128 // Video packets kept in PSRAM per UDP client, with RTSP_VIDEO_NACK
+#endif
+
+#define RTP_FEC_PAYLOAD_TYPE 100
+#define RTP_FEC_HEADER_SIZE 14 // RFC 5109 FEC header and level 0 header with a 16 bit mask
+#define RTP_FEC_MAX_GROUP 16
+
+#define RTSP_RATE_LEVELS 8
+#ifndef RTSP_RATE_INTERVAL_MS
+#define RTSP_RATE_INTERVAL_MS 1000 // How often the rate controller looks at the network
+#endif
+
+#ifndef RTSP_AUDIO_RING_MS
+#define RTSP_AUDIO_RING_MS 200 // Audio the capture side can queue ahead of the packetizer
+#endif
+
+#ifndef RTP_TCP_MAX_PAYLOAD
+#define RTP_TCP_MAX_PAYLOAD 60000 // Interleaved packets can carry up to 65535 bytes
+#endif
+
+#ifndef RTP_PACE_BURST
+#define RTP_PACE_BURST 6000 // Bytes of a paced frame sent back to back, about 4 UDP packets
+#endif
+#define RTP_PACE_MIN_WAIT_US 1000 // Shorter waits are saved up, a timer wake per packet costs more than it spreads
+
+#ifndef RTSP_TCP_QUEUE_SIZE
+#define RTSP_TCP_QUEUE_SIZE (128 * 1024) // Bytes queued per TCP client in PSRAM, an eighth of it without PSRAM
+#endif
+
+#ifndef RTSP_TCP_QUEUE_MAX
+#define RTSP_TCP_QUEUE_MAX (256 * 1024) // Most a TCP client's queue grows to for large frames, an eighth of it without PSRAM
+#endif
+
+// One packet of a packetized frame or audio block, the payload points into the caller's data
+struct RTP_Packet {
+  uint8_t header[MAX_RTP_PACKET_HEADER];  // Interleaved prefix, RTP header and payload header
+  uint8_t headerLen;
+  const uint8_t* headerExt;  // Optional segment sent between header and payload eg. JPEG quantization tables
+  uint16_t headerExtLen;
+  const uint8_t* payload;
+  uint16_t payloadLen;
+};
+
+// Packets of the current frame or audio block for one max payload size
+struct RTP_PacketList {
+  uint16_t maxPayload;
+  uint32_t number;  // Frame or audio block these packets belong to
+  std::vector<RTP_Packet> packets;
+};
+
+// Frame being sent, packetized on demand for each payload size in use
+struct RTP_VideoFrame {
+  const uint8_t* data;  // Payload data, the scan data for RFC 2435 frames
+  size_t len;
+  uint8_t type;
+  uint8_t quality;
+  uint16_t width;
+  uint16_t height;
+  uint16_t restartInterval;
+  const uint8_t* qTables;  // Quantization table header for the first packet, NULL if none
+  uint16_t qTablesLen;
+};
+
+// Baseline JPEG frame as needed for RFC 2435 packetization
+struct JPEG_Info {
+  const uint8_t* scanData;  // Entropy coded data, without headers and EOI
+  size_t scanLen;
+  uint16_t width;
+  uint16_t height;
+  uint8_t type;  // RTP/JPEG type, 0 for 4:2:2 and 1 for 4:2:0
+  uint16_t restartInterval;  // MCUs per restart interval from DRI, 0 if none
+  const uint8_t* qTables[2];  // Luma and chroma quantization tables, zigzag order
+};
+
+// Reception quality of one track from the receiver's RTCP reports
+struct RTCP_ReceiverStats {
+  uint8_t fractionLost;  // Lost since the previous report, out of 256
+  int32_t cumulativeLost;
+  uint32_t highestSequence;  // Extended highest sequence number received
+  uint32_t jitter;  // Interarrival jitter in timestamp units
+  uint32_t rttUs;  // Round trip time, 0 until known
+  uint32_t reports;  // Number of reports received
+  std::atomic<bool> fresh;  // A report arrived since the rate controller last looked, set by the RTSP task
+};
+
+// Token bucket, the time is passed in so it can run against a virtual clock
+struct RTP_TokenBucket {
+  uint32_t rate;  // Bytes per second, 0 for no limit
+  uint32_t burst;  // Most tokens held
+  int64_t tokens;  // Bytes that can be sent, negative after a send larger than what was held
+  int64_t lastUs;  // When tokens was last brought up to date
+};
+
+void tokenBucketStart(RTP_TokenBucket& bucket, uint32_t rate, uint32_t burst, int64_t nowUs);  // Defined in pacer.cpp
+
+int64_t tokenBucketDelay(const RTP_TokenBucket& bucket, int64_t nowUs);  // Defined in pacer.cpp
+
+void tokenBucketTake(RTP_TokenBucket& bucket, size_t bytes, int64_t nowUs);  // Defined in pacer.cpp
+
+uint32_t framePacingRate(size_t bytes, uint32_t fps, uint8_t percent);  // Defined in pacer.cpp
+
+int64_t pacingDelay(const RTP_TokenBucket& bucket, int64_t nowUs);  // Defined in pacer.cpp
+
+#define RTSP_EGRESS_RECORD_SIZE 4 // Length stored before each queued packet
+
+// Priority classes of queued packets, highest first
+enum RTSP_EgressClass {
+  RTSP_EGRESS_AUDIO,
+  RTSP_EGRESS_DATA,  // Subtitles, RTCP and RTSP responses
+  RTSP_EGRESS_VIDEO,
+  RTSP_EGRESS_CLASSES,
+};
+
+// Queued packets of one priority class, each after its length
+struct RTSP_EgressRing {
+  uint8_t* buffer;  // Part of the queue's buffer
+  size_t size;
+  size_t head;  // Next byte to write
+  size_t len;
+};
+
+// Interleaved packets written to a TCP or HTTP client as its socket takes them
+struct RTSP_EgressQueue {
+  uint8_t* buffer;  // Split into the rings, allocated on the first TCP SETUP of the slot, grown for larger frames and reused
+  size_t size;
+  RTSP_EgressRing rings[RTSP_EGRESS_CLASSES];
+  size_t len;  // Bytes queued in all rings, packets are only added whole
+  uint8_t active;  // Class of the packet being written
+  size_t remaining;  // Bytes of that packet still to write, it goes out before any other
+  int sock;  // Socket the packets go to, -1 when not in use
+  int64_t progressUs;  // When the socket last took data
+  int64_t backlogSinceUs;  // When the queue last stopped being empty, 0 while empty
+  uint32_t droppedPackets;
+  uint32_t skippedFrames;  // Whole frames not sent because the client was behind
+  bool evicted;  // Disconnected for being too slow, nothing more is sent
+};
+
+// RTP state of one track as seen by one receiver
+struct RTP_TrackState {
+  uint16_t sequenceNumber;
+  uint32_t ssrc;
+  uint32_t timestampOffset;  // Added to the media timestamp
+  uint8_t channel;  // Interleaved RTP channel, RTCP uses channel + 1
+  uint32_t packetCount;  // Sent packets and payload octets for sender reports
+  uint32_t octetCount;
+  int64_t lastSrUs;  // When the last sender report was sent, 0 before the first
+  RTCP_ReceiverStats stats;
+  uint8_t* history;  // Recently sent packets for NACK retransmission, NULL if not kept
+  uint16_t historySlot;  // Bytes per history entry
+  uint16_t rtxSequence;  // RFC 4588 retransmission stream
+  uint32_t rtxSsrc;
+  RTSP_EgressQueue* egress;  // Queue of the TCP connection the track is interleaved on, NULL for UDP
+  RTSP_EgressClass egressClass;  // Priority of the track's RTP packets in the queue
+  struct sockaddr_in rtpAddr;  // UDP destination, resolved on SETUP, port 0 if not set
+  struct sockaddr_in rtcpAddr;
+};
+
+// ULPFEC parity over a group of sent packets
+struct RTP_FecState {
+  uint8_t* payload;  // XOR of the protected payloads
+  uint8_t header[RTP_FEC_HEADER_SIZE];
+  uint16_t protectionLength;  // Longest protected payload
+  uint16_t lengthRecovery;
+  uint32_t timestampRecovery;
+  uint8_t byteRecovery;  // XOR of the marker and payload type bytes
+  uint16_t sequenceBase;
+  uint32_t timestamp;  // Media timestamp of the last protected packet
+  uint8_t count;
+};
+
+// Single producer (sendRTSPAudio), single consumer (rtpAudioTask) ring of raw samples
+struct RTP_AudioRing {
+  uint8_t* buffer;
+  size_t size;
+  std::atomic<size_t> head;  // Total bytes written, only advanced by the producer
+  std::atomic<size_t> tail;  // Total bytes read, only advanced by the consumer
+  std::atomic<int64_t> headTime;  // Capture time in us of the sample at head
+};
+
 struct RTSP_Session {
   uint32_t sessionID;
-  int sock;
+  int sock;  // -1 when the slot is free
+  bool inUse;
   int cseq;
   uint16_t cVideoPort;
   uint16_t cAudioPort;
@@ -48,9 +249,99 @@ struct RTSP_Session {
   bool isTCP;
   bool isHttp;  // Add flag for HTTP tunneling
   int httpSock;  // Add HTTP socket storage
+  uint16_t maxPayload;  // Max RTP payload size for this transport, including payload headers
+  uint16_t audioMaxPayload;  // Max audio payload, smaller when the TCP audio ring is
+  uint8_t maxFps;  // Frame rate the client asked for with ?fps=, 0 for every frame
+  uint32_t nextFrameTimestamp;  // Video timestamp the next frame is due when decimating
+  RTP_TokenBucket bitrateBucket;  // Video bytes allowed by maxSessionBitrate
   char sessionCookie[MAX_COOKIE_LENGTH];  // Add storage for session cookie
+  uint32_t cookieHash;  // Hash of sessionCookie, 0 if there is none
+  RTP_TrackState videoTrack;
+  RTP_TrackState audioTrack;
+  RTP_TrackState subtitlesTrack;
+};
+
+enum RTSP_Method {
+  RTSP_METHOD_UNKNOWN,
+  RTSP_METHOD_OPTIONS,
+  RTSP_METHOD_DESCRIBE,
+  RTSP_METHOD_SETUP,
+  RTSP_METHOD_PLAY,
+  RTSP_METHOD_PAUSE,
+  RTSP_METHOD_TEARDOWN,
+  RTSP_METHOD_HTTP_GET,  // RTSP over HTTP tunnel
+  RTSP_METHOD_HTTP_POST,
+};
+
+// Headers the server reads, other headers are skipped
+enum RTSP_HeaderId {
+  RTSP_HEADER_CSEQ,
+  RTSP_HEADER_SESSION,
+  RTSP_HEADER_TRANSPORT,
+  RTSP_HEADER_AUTHORIZATION,
+  RTSP_HEADER_COOKIE,
+  RTSP_HEADER_ACCEPT,
+  RTSP_HEADER_CONTENT_TYPE,
+  RTSP_HEADER_CONTENT_LENGTH,
+  RTSP_HEADER_COUNT,
+};
+
+// Part of a received request, not null terminated
+struct RTSP_Span {
+  const char* data;
+  uint16_t len;
+};
+
+// Request as parsed from the receive buffer, the spans point into the buffer
+struct RTSP_Request {
+  RTSP_Method method;
+  RTSP_Span url;
+  RTSP_Span path;  // URL path without the query eg. /video
+  RTSP_Span query;  // After '?', empty if none
+  RTSP_Span track;  // Last path segment eg. video
+  RTSP_Span headers[RTSP_HEADER_COUNT];  // Header values, empty if not sent
+  RTSP_Span body;
+  int cseq;  // -1 if not sent
+  uint32_t sessionID;  // 0 if not sent
+  uint8_t fps;  // Frame rate asked for with ?fps= in the query, 0 if not sent
+};
+
+// First transport of a SETUP Transport header
+struct RTSP_Transport {
+  bool isTCP;
+  bool isMulticast;
+  bool isAVPF;
+  uint16_t clientPort;  // RTP port of a UDP receiver, RTCP is the next port
+  bool hasInterleaved;
+  uint8_t interleaved;  // RTP channel over TCP, RTCP is the next channel
+};
+
+// Sessions playing when the list was published, read by the sender tasks without locks
+struct RTSP_PlayingList {
+  RTSP_Session* sessions[MAX_CLIENTS];  // Unicast sessions, then at most one multicast session
+  uint8_t count;
+  std::atomic<uint8_t> readers;  // Senders using the list, it is not reused until they are done
 };
 
+// Bytes received on an RTSP connection, kept until they form complete requests
+struct RTSP_RecvBuffer {
+  char* data;  // RTSP_BUFFER_SIZE bytes, allocated on the first connection and reused
+  uint16_t len;
+  uint16_t skipLen;  // Rest of an interleaved packet too large for the buffer, dropped as it arrives
+  char base64Tail[3];  // End of tunnelled base64 short of a 4 character group, decoded with the next read
+  uint8_t base64Len;
+};
+
+// Capture settings recommended by the rate controller
+struct RTSP_RateAdvice {
+  uint8_t level;  // 0 when the network keeps up, RTSP_RATE_LEVELS - 1 when most congested
+  uint8_t quality;  // JPEG quality for sensor_t::set_quality, lower is better
+  int8_t frameSizeSteps;  // Steps below the configured framesize, 0 or negative
+  uint8_t fps;  // Target frame rate, 0 for no limit
+};
+
+typedef void (*RTSP_RateCallback)(const RTSP_RateAdvice& advice);
+
 class RTSPServer {
 public:
   enum TransportType {
@@ -64,6 +355,18 @@ public:
     NONE,
   };
 
+  enum AudioCodec {
+    AUDIO_L16,   // 16 bit linear PCM
+    AUDIO_PCMU,  // G.711 mu-law
+    AUDIO_PCMA,  // G.711 A-law
+    AUDIO_DVI4,  // IMA ADPCM, 4 bits per sample
+  };
+
+  enum QueuePolicy {
+    QUEUE_DROP_FRAME,  // Drop the rest of a frame that does not fit, the client resumes with a later frame
+    QUEUE_EVICT,       // Disconnect the client
+  };
+
   RTSPServer();  // Defined in ESP32-RTSPServer.cpp
   ~RTSPServer();  // Destructor, defined in ESP32-RTSPServer.cpp
 
@@ -73,12 +376,22 @@ public:
 
   bool reinit();  // Defined in ESP32-RTSPServer.cpp
 
+  void sendRTSPFrame(const uint8_t* data, size_t len);  // Defined in rtp.cpp
+
+  void sendRTSPFrame(const uint8_t* data, size_t len, int64_t captureUs);  // Defined in rtp.cpp
+
   void sendRTSPFrame(const uint8_t* data, size_t len, int quality, int width, int height);  // Defined in rtp.cpp
 
-  void sendRTSPAudio(int16_t* data, size_t len);  // Defined in rtp.cpp
+  void sendRTSPFrame(const uint8_t* data, size_t len, int quality, int width, int height, int64_t captureUs);  // Defined in rtp.cpp
+
+  void sendRTSPAudio(int16_t* data, size_t len, bool bigEndian = false);  // Defined in rtp.cpp
+
+  void sendRTSPAudio(int16_t* data, size_t len, int64_t captureUs, bool bigEndian = false);  // Defined in rtp.cpp
 
   void sendRTSPSubtitles(char* data, size_t len);  // Defined in rtp.cpp
 
+  void sendRTSPSubtitles(char* data, size_t len, int64_t captureUs);  // Defined in rtp.cpp
+
   void startSubtitlesTimer(esp_timer_cb_t userCallback);  // Defined in utils.cpp
 
   bool readyToSendFrame() const;  // Defined in utils.cpp
@@ -89,7 +402,12 @@ public:
 
   bool setCredentials(const char* username, const char* password); // Add method to set credentials
 
+  void setRateCallback(RTSP_RateCallback callback);  // Defined in rateControl.cpp
+
+  RTSP_RateAdvice getRateAdvice() const;  // Defined in rateControl.cpp
+
   uint32_t rtpFps;
+  std::atomic<uint32_t> rtpFramesSkipped;  // Frames skipped for TCP clients that were behind, for all clients since init
   TransportType transport;
   uint32_t sampleRate;
   int rtspPort;
@@ -98,7 +416,19 @@ public:
   uint16_t rtpVideoPort;
   uint16_t rtpAudioPort;
   uint16_t rtpSubtitlesPort;
+  uint16_t rtpFecPort;  // Multicast ULPFEC stream, see fecGroupSize
   uint8_t maxRTSPClients;
+  uint16_t rtpMtu;  // MTU of the UDP path, lower it for VPN or PPPoE links
+  AudioCodec audioCodec;  // Encoding of the samples passed to sendRTSPAudio, set before init
+  uint16_t audioPtime;  // Audio packet duration in ms, 0 sends each sendRTSPAudio block as is
+  uint8_t fecGroupSize;  // Multicast video packets per ULPFEC parity packet, 0 disables
+  uint8_t maxSessionFps;  // Frame rate cap of each unicast client, 0 for none
+  uint32_t maxSessionBitrate;  // Video bits per second cap of each unicast client, 0 for none
+  uint8_t pacingPercent;  // Share of the frame interval the UDP packets of a frame are spread over, 0 sends them back to back
+  uint8_t rateMinQuality;  // Best JPEG quality the rate controller recommends
+  uint8_t rateMaxQuality;  // Worst JPEG quality the rate controller recommends
+  QueuePolicy tcpQueuePolicy;  // What happens to a TCP client whose send queue is full or past the deadline
+  uint16_t tcpSendDeadlineMs;  // Longest a TCP client may leave queued data unread
 
 private:
   int rtspSocket;
@@ -108,58 +438,215 @@ private:
   int videoMulticastSocket; 
   int audioMulticastSocket; 
   int subtitlesMulticastSocket;
+  int videoRtcpSocket;  // Unicast RTCP on the server port + 1
+  int audioRtcpSocket;
+  int subtitlesRtcpSocket;
   uint8_t activeRTSPClients; 
-  uint8_t maxClients;
+  std::atomic<uint8_t> maxClients;
   TaskHandle_t rtpVideoTaskHandle;
+  TaskHandle_t rtpAudioTaskHandle;
   TaskHandle_t rtspTaskHandle;
-  std::map<uint32_t, RTSP_Session> sessions;
+  RTSP_Session sessions[MAX_CLIENTS];  // One slot per client connection
+  RTSP_RecvBuffer recvBuffers[MAX_CLIENTS];  // Receive buffer of the connection in the same slot
+  RTSP_EgressQueue egressQueues[MAX_CLIENTS];  // Send queue of the connection in the same slot
+  RTSP_PlayingList playingLists[2];  // Published list and the one rebuilt next
+  std::atomic<RTSP_PlayingList*> playingList;
+  RTP_VideoFrame videoFrame;  // Current frame, packetized once per payload size for all sessions
+  uint32_t videoFrameNumber;
+  RTP_PacketList videoPacketLists[RTP_PACKET_LISTS];
+  const uint8_t* audioData;  // Current audio block, payloads reference the caller's samples
+  size_t audioLen;
+  size_t audioSamples;
+  uint32_t audioBlockNumber;
+  std::vector<uint8_t> adpcmHeaders;  // DVI4 header of each audio packet
+  int adpcmPredictor;  // DVI4 encoder state, continues across blocks
+  int adpcmIndex;
+  RTP_AudioRing audioRing;
+  uint8_t* audioFrameBuffer;  // One ptime of samples read from the ring
+  std::atomic<bool> audioTaskStop;  // Asks rtpAudioTask to exit, cleared by the task when it does
+  bool audioMarker;  // Set the marker bit on the next audio packet, starts a talkspurt
+  int64_t lastAudioCaptureUs;
+  int32_t audioClockDrift;  // Audio timestamp minus the media clock, for sender reports
+  RTP_FecState videoFec;
+  RTP_TokenBucket videoPacer;  // Paces the UDP packets of the current frame
+  bool pacing;  // The current frame is paced
+  esp_timer_handle_t pacerTimer;
+  SemaphoreHandle_t pacerSemaphore;  // Given by pacerTimer to end a wait
+  RTSP_RateCallback rateCallback;
+  RTSP_RateAdvice rateAdvice;
+  uint8_t rateCleanIntervals;  // Intervals without congestion since the last change
+  std::atomic<uint32_t> rateTcpWaits;  // Congestion signals since the last rate update, counted by any sending task
+  std::atomic<uint32_t> rateTcpWaitUs;
+  std::atomic<uint32_t> rateTcpDrops;
+  std::atomic<uint32_t> rateUdpErrors;
+  std::atomic<uint32_t> rateUdpSends;  // UDP sends tried, for the share of them that failed
+  uint32_t lastRateUpdateTime;
+  RTP_PacketList audioPacketLists[RTP_PACKET_LISTS];
+  RTP_Packet subtitlesPacket;
   byte* rtspStreamBuffer;
   size_t rtspStreamBufferSize;
-  bool rtpFrameSent;
-  bool rtpAudioSent;
-  bool rtpSubtitlesSent;
+  std::atomic<bool> rtpFrameSent;
+  std::atomic<bool> rtpAudioSent;
+  std::atomic<bool> rtpSubtitlesSent;
   uint8_t vQuality;
   uint16_t vWidth;
   uint16_t vHeight;
-  uint16_t videoSequenceNumber;
   uint32_t videoTimestamp;
-  uint32_t videoSSRC;
-  uint16_t audioSequenceNumber;
   uint32_t audioTimestamp;
-  uint32_t audioSSRC;
-  uint16_t subtitlesSequenceNumber;
   uint32_t subtitlesTimestamp;
-  uint32_t subtitlesSSRC;
+  RTP_TrackState videoMulticastTrack;  // Multicast receivers share one RTP stream per track
+  RTP_TrackState audioMulticastTrack;
+  RTP_TrackState subtitlesMulticastTrack;
+  RTP_TrackState fecMulticastTrack;  // ULPFEC parity of videoMulticastTrack, a stream of its own
+  uint8_t qTableHeader[RTP_JPEG_QTABLE_HEADER_SIZE + 128];  // RFC 2435 quantization table header and tables
+  uint8_t jpegQ;  // Q value of the current quantization tables
+  bool qTablesPending;  // Send the tables with the next frame
+  uint32_t lastQTablesTime;
   uint32_t rtpFrameCount;
   uint32_t lastRtpFPSUpdateTime;
-  uint8_t videoCh;
-  uint8_t audioCh;
-  uint8_t subtitlesCh;
   bool isVideo;
   bool isAudio;
   bool isSubtitles;
-  bool isPlaying;
+  std::atomic<bool> isPlaying;
   bool firstClientConnected; 
   bool firstClientIsMulticast; 
   bool firstClientIsTCP;
   bool authEnabled; // Flag to indicate if authentication is enabled
   char base64Credentials[128]; // Store base64 encoded credentials
   esp_timer_handle_t sendSubtitlesTimer;
-  SemaphoreHandle_t isPlayingMutex;  // Mutex for protecting access
   SemaphoreHandle_t sendTcpMutex;  // Mutex for protecting TCP send access
-  SemaphoreHandle_t maxClientsMutex; // FreeRTOS mutex for maxClients
 
   void closeSockets();  // Defined in ESP32-RTSPServer.cpp
   
-  void sendTcpPacket(const uint8_t* packet, size_t packetSize, int sock);  // Defined in network.cpp
+  void startEgressQueue(RTSP_EgressQueue& queue, int sock);  // Defined in network.cpp
+
+  void stopEgressQueue(RTSP_EgressQueue& queue);  // Defined in network.cpp
+
+  void drainEgressQueue(RTSP_EgressQueue& queue);  // Defined in network.cpp
+
+  bool egressQueueLate(const RTSP_EgressQueue& queue, int64_t now) const;  // Defined in network.cpp
+
+  bool egressQueueFits(RTSP_EgressQueue& queue, size_t len, size_t packets);  // Defined in network.cpp
+
+  void evictEgressClient(RTSP_EgressQueue& queue);  // Defined in network.cpp
+
+  void serviceEgressQueue(RTSP_EgressQueue& queue);  // Defined in network.cpp
+
+  bool sendTcpPacket(const uint8_t* packet, size_t packetSize, RTSP_EgressQueue& queue, RTSP_EgressClass priority);  // Defined in network.cpp
+
+  bool sendTcpPacket(struct iovec* iov, int iovcnt, RTSP_EgressQueue& queue, RTSP_EgressClass priority);  // Defined in network.cpp
+
+  void sendTcpPacket(struct iovec* iov, int iovcnt, int sock);  // Defined in network.cpp
+
+  void sendResponse(const RTSP_Session& session, const char* response, size_t len);  // Defined in network.cpp
 
   void checkAndSetupUDP(int& rtpSocket, bool isMulticast, uint16_t rtpPort, IPAddress rtpIp = IPAddress());  // Defined in network.cpp
 
-  void sendRtpSubtitles(const char* data, size_t len, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast);  // Defined in rtp.cpp
+  uint32_t multicastDestinationIp() const;  // Defined in network.cpp
+
+  uint32_t clientDestinationIp(const RTSP_Session& session);  // Defined in network.cpp
+
+  void setTrackDestination(RTP_TrackState& track, uint32_t ip, uint16_t port);  // Defined in network.cpp
+
+  void packetizeSubtitles(const char* data, size_t len);  // Defined in rtp.cpp
+
+  void sendRtpSubtitles(RTP_TrackState& track, bool useTCP, bool isMulticast);  // Defined in rtp.cpp
+
+  void prepareAudio(int16_t* data, size_t len, bool bigEndian);  // Defined in rtp.cpp
+
+  void packetizeAudio(std::vector<RTP_Packet>& packets, uint16_t maxPayload);  // Defined in rtp.cpp
+
+  const std::vector<RTP_Packet>& getAudioPackets(uint16_t maxPayload);  // Defined in rtp.cpp
+
+  void swapSamples(int16_t* data, size_t samples);  // Defined in audioCodecs.cpp
+
+  void encodeG711(int16_t* data, size_t samples, bool aLaw);  // Defined in audioCodecs.cpp
+
+  size_t encodeDvi4(int16_t* data, size_t samples, size_t blockLen, std::vector<uint8_t>& headers);  // Defined in audioCodecs.cpp
+
+  uint8_t audioPayloadType() const;  // Defined in audioCodecs.cpp
+
+  const char* audioEncodingName() const;  // Defined in audioCodecs.cpp
+
+  void sendAudioBlock(int16_t* data, size_t len, bool bigEndian, int64_t captureUs);  // Defined in rtp.cpp
+
+  size_t audioFrameLen() const;  // Defined in rtp.cpp
+
+  bool startAudioRing();  // Defined in rtp.cpp
+
+  void stopAudioRing();  // Defined in rtp.cpp
+
+  size_t writeAudioRing(const uint8_t* data, size_t len, int64_t captureUs);  // Defined in rtp.cpp
+
+  size_t readAudioRing(uint8_t* data, size_t len, int64_t& captureUs);  // Defined in rtp.cpp
+
+  static void rtpAudioTaskWrapper(void* pvParameters);  // Defined in rtp.cpp
+
+  void rtpAudioTask();  // Defined in rtp.cpp
+
+  void sendRtpAudio(const std::vector<RTP_Packet>& packets, RTP_TrackState& track, bool useTCP, bool isMulticast);  // Defined in rtp.cpp
+
+  bool parseJpeg(const uint8_t* data, size_t len, JPEG_Info& jpeg);  // Defined in jpegUtils.cpp
+
+  bool updateQTables(const JPEG_Info& jpeg);  // Defined in jpegUtils.cpp
+
+  size_t findNextRestart(const uint8_t* data, size_t len, size_t offset);  // Defined in jpegUtils.cpp
+
+  bool prepareFrame(const uint8_t* data, size_t len, uint8_t quality, uint16_t width, uint16_t height);  // Defined in rtp.cpp
+
+  void packetizeFrame(std::vector<RTP_Packet>& packets, uint16_t maxPayload);  // Defined in rtp.cpp
 
-  void sendRtpAudio(const int16_t* data, size_t len, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast);  // Defined in rtp.cpp
+  const std::vector<RTP_Packet>& getVideoPackets(uint16_t maxPayload);  // Defined in rtp.cpp
 
-  void sendRtpFrame(const uint8_t* data, size_t len, uint8_t quality, uint16_t width, uint16_t height, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast);  // Defined in rtp.cpp
+  RTP_PacketList& selectPacketList(RTP_PacketList* lists, uint16_t maxPayload, uint32_t number);  // Defined in rtp.cpp
+
+  uint16_t udpMaxPayload() const;  // Defined in rtp.cpp
+
+  void sendVideoFrame(const uint8_t* data, size_t len, uint8_t quality, uint16_t width, uint16_t height);  // Defined in rtp.cpp
+
+  bool selectFrame(RTSP_Session& session);  // Defined in rtp.cpp
+
+  void sendRtpFrame(const std::vector<RTP_Packet>& packets, RTP_TrackState& track, bool useTCP, bool isMulticast);  // Defined in rtp.cpp
+
+  void sendSenderReport(RTP_TrackState& track, uint32_t clockRate, int32_t clockDrift, int rtcpSocket, bool useTCP);  // Defined in rtcp.cpp
+
+  void handleRtcp(const uint8_t* data, size_t len);  // Defined in rtcp.cpp
+
+  void startRateControl();  // Defined in rateControl.cpp
+
+  void updateRateControl();  // Defined in rateControl.cpp
+
+  void setRateLevel(uint8_t level);  // Defined in rateControl.cpp
+
+  void handleInterleaved(uint8_t channel, const uint8_t* data, size_t len);  // Defined in rtcp.cpp
+
+  void handleRtcpSocket(int rtcpSocket);  // Defined in rtcp.cpp
+
+  RTP_TrackState* findTrackBySSRC(uint32_t ssrc);  // Defined in rtcp.cpp
+
+  static void pacerTimerCallback(void* arg);  // Defined in pacer.cpp
+
+  void startFramePacing(size_t bytes);  // Defined in pacer.cpp
+
+  void pacePacket(size_t bytes);  // Defined in pacer.cpp
+
+  bool takeSessionBitrate(RTSP_Session& session, size_t bytes);  // Defined in pacer.cpp
+
+  void addFecPacket(const RTP_Packet& packet, uint16_t sequenceNumber, uint32_t timestampOffset);  // Defined in fec.cpp
+
+  void sendFecPacket(int rtpSocket);  // Defined in fec.cpp
+
+  bool startHistory(RTP_TrackState& track);  // Defined in rtx.cpp
+
+  void freeHistory(RTP_TrackState& track);  // Defined in rtx.cpp
+
+  void storeHistory(RTP_TrackState& track, uint16_t sequenceNumber, const struct iovec* iov, int iovcnt);  // Defined in rtx.cpp
+
+  void handleNack(uint32_t ssrc, const uint8_t* fci, size_t len);  // Defined in rtx.cpp
+
+  void retransmitPacket(RTSP_Session& session, uint16_t sequenceNumber);  // Defined in rtx.cpp
+
+  bool sendRtpPacket(const RTP_Packet& packet, RTP_TrackState& track, int rtpSocket, bool useTCP);  // Defined in rtp.cpp
 
   static void rtpVideoTaskWrapper(void* pvParameters);  // Defined in rtp.cpp
 
@@ -178,24 +665,48 @@ private:
   uint8_t getActiveRTSPClients();  // Defined in utils.cpp
 
   void updateIsPlayingStatus();  // Defined in utils.cpp
+
+  uint8_t publishPlayingList();  // Defined in utils.cpp
+
+  bool holdSession(RTSP_Session& session);  // Defined in utils.cpp
+
+  void unholdSession(RTSP_Session& session, bool wasPlaying);  // Defined in utils.cpp
+
+  RTSP_PlayingList* acquirePlayingList();  // Defined in utils.cpp
+
+  void releasePlayingList(RTSP_PlayingList* list);  // Defined in utils.cpp
+
+  void initTrackState(RTP_TrackState& track, uint8_t channel);  // Defined in utils.cpp
+
+  uint32_t mediaTimestamp(int64_t captureUs, uint32_t clockRate) const;  // Defined in utils.cpp
   
   void setIsPlaying(bool playing);  // Defined in utils.cpp
   
   bool getIsPlaying() const;  // Defined in utils.cpp
 
-  int captureCSeq(char* request);  // Defined in utils.cpp
+  uint32_t generateSessionID(uint8_t slot);  // Defined in utils.cpp
+
+  RTSP_Session* findSession(uint32_t sessionID);  // Defined in utils.cpp
 
-  uint32_t generateSessionID();  // Defined in utils.cpp
+  void freeSession(RTSP_Session& session);  // Defined in utils.cpp
 
-  uint32_t extractSessionID(char* request);  // Defined in utils.cpp
+  uint32_t hashCookie(const char* cookie);  // Defined in utils.cpp
 
   const char* dateHeader();  // Defined in utils.cpp
 
-  void handleOptions(char* request, RTSP_Session& session);  // Defined in rtsp_requests.cpp
+  int parseRTSPRequest(const char* data, size_t len, RTSP_Request& request);  // Defined in rtspParser.cpp
+
+  void parseTransport(const RTSP_Span& value, RTSP_Transport& transport);  // Defined in rtspParser.cpp
+
+  bool spanEquals(const RTSP_Span& span, const char* str) const;  // Defined in rtspParser.cpp
+
+  bool spanStartsWith(const RTSP_Span& span, const char* str) const;  // Defined in rtspParser.cpp
+
+  void handleOptions(RTSP_Session& session);  // Defined in rtsp_requests.cpp
 
   void handleDescribe(const RTSP_Session& session);  // Defined in rtsp_requests.cpp
 
-  void handleSetup(char* request, RTSP_Session& session);  // Defined in rtsp_requests.cpp
+  void handleSetup(const RTSP_Request& request, RTSP_Session& session);  // Defined in rtsp_requests.cpp
 
   void handlePlay(RTSP_Session& session);  // Defined in rtsp_requests.cpp
 
@@ -203,7 +714,11 @@ private:
 
   void handleTeardown(RTSP_Session& session);  // Defined in rtsp_requests.cpp
 
-  bool handleRTSPRequest(RTSP_Session& session);  // Defined in rtsp_requests.cpp
+  bool handleRTSPRequest(RTSP_Session& session, RTSP_RecvBuffer& recvBuffer);  // Defined in rtsp_requests.cpp
+
+  int dispatchRTSPData(RTSP_Session& session, RTSP_RecvBuffer& recvBuffer, char* data, size_t len);  // Defined in rtsp_requests.cpp
+
+  void processRTSPRequest(const RTSP_Request& request, RTSP_Session& session);  // Defined in rtsp_requests.cpp
 
   bool setNonBlocking(int sockfd);  // Defined in network.cpp
 
@@ -216,9 +731,9 @@ private:
   static const char* LOG_TAG;  // Define a log tag for the class
 
   void sendUnauthorizedResponse(RTSP_Session& session); // Add method to send 401 Unauthorized response
-  void extractSessionCookie(const char* buffer, char* sessionCookie, size_t maxLen);
+  void copySessionCookie(const RTSP_Span& cookie, char* sessionCookie, size_t maxLen);
   bool isBase64Encoded(const char* buffer, size_t length);
-  void handleRTSPCommand(char* command, RTSP_Session& session);
+  void handleRTSPCommand(const RTSP_Request& request, RTSP_Session& session);
   bool decodeBase64(const char* input, size_t inputLen, char* output, size_t* outputLen);
   void wrapInHTTP(char* buffer, size_t len, char* response, size_t maxLen);  // Add this line
   RTSP_Session* findSessionByCookie(const char* cookie);  // Add this line
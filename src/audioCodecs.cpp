@@ -0,0 +1,237 @@
+#include "ESP32-RTSPServer.h"
+
+// Number of significant bits of 0-127, used to find the G.711 segment
+struct BitLengthTable {
+  uint8_t bits[128];
+  constexpr BitLengthTable() : bits() {
+    for (int i = 1; i < 128; i++) {
+      int n = 0;
+      for (int v = i; v; v >>= 1) n++;
+      bits[i] = n;
+    }
+  }
+};
+static constexpr BitLengthTable bitLength;
+
+// IMA ADPCM quantizer step sizes and step index adjustments
+static constexpr int16_t imaStepTable[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+  12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+static constexpr int8_t imaIndexTable[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+/**
+ * @brief Encodes a 16 bit sample as G.711 mu-law, matching the ITU-T G.191 reference.
+ */
+static inline uint8_t encodeULaw(int16_t sample) {
+  int absno = (sample < 0) ? ((~sample) >> 2) + 33 : (sample >> 2) + 33;
+  if (absno > 0x1FFF) {
+    absno = 0x1FFF;
+  }
+  int segno = bitLength.bits[absno >> 6] + 1;
+  uint8_t code = ((8 - segno) << 4) | (0x0F - ((absno >> segno) & 0x0F));
+  return (sample >= 0) ? (code | 0x80) : code;
+}
+
+/**
+ * @brief Encodes a 16 bit sample as G.711 A-law, matching the ITU-T G.191 reference.
+ */
+static inline uint8_t encodeALaw(int16_t sample) {
+  int ix = (sample < 0) ? (~sample) >> 4 : sample >> 4;
+  if (ix > 15) {
+    int iexp = bitLength.bits[ix >> 4];
+    ix = (iexp << 4) | ((ix >> (iexp - 1)) & 0x0F);
+  }
+  if (sample >= 0) {
+    ix |= 0x80;
+  }
+  return ix ^ 0x55;
+}
+
+/**
+ * @brief Encodes one sample with the IMA ADPCM encoder state.
+ */
+static inline uint8_t encodeIma(int16_t sample, int& predictor, int& index) {
+  int step = imaStepTable[index];
+  int diff = sample - predictor;
+  uint8_t code = 0;
+  if (diff < 0) {
+    code = 8;
+    diff = -diff;
+  }
+  int vpdiff = step >> 3;
+  if (diff >= step) {
+    code |= 4;
+    diff -= step;
+    vpdiff += step;
+  }
+  step >>= 1;
+  if (diff >= step) {
+    code |= 2;
+    diff -= step;
+    vpdiff += step;
+  }
+  step >>= 1;
+  if (diff >= step) {
+    code |= 1;
+    vpdiff += step;
+  }
+  predictor += (code & 8) ? -vpdiff : vpdiff;
+  if (predictor > 32767) {
+    predictor = 32767;
+  } else if (predictor < -32768) {
+    predictor = -32768;
+  }
+  index += imaIndexTable[code];
+  if (index < 0) {
+    index = 0;
+  } else if (index > 88) {
+    index = 88;
+  }
+  return code;
+}
+
+/**
+ * @brief Swaps the byte order of 16 bit samples in place, two samples per 32 bit word.
+ *
+ * On the ESP32-S3 the PIE vector unit swaps 16 samples at a time: two 128 bit
+ * loads are split into their low and high bytes and zipped back the other way
+ * round.
+ *
+ * @param data The samples.
+ * @param samples Number of samples.
+ */
+void RTSPServer::swapSamples(int16_t* data, size_t samples) {
+  uint16_t* half = reinterpret_cast<uint16_t*>(data);
+#if CONFIG_IDF_TARGET_ESP32S3
+  // The vector loads and stores need 16 byte alignment
+  while (samples && (reinterpret_cast<uintptr_t>(half) & 15)) {
+    *half = (uint16_t)((*half << 8) | (*half >> 8));
+    half++;
+    samples--;
+  }
+  for (size_t blocks = samples / 16; blocks > 0; blocks--) {
+    asm volatile(
+      "ee.vld.128.ip q0, %0, 16\n\t"
+      "ee.vld.128.ip q1, %0, -16\n\t"
+      "ee.vunzip.8 q0, q1\n\t"  // q0 the low bytes, q1 the high bytes
+      "ee.vzip.8 q1, q0\n\t"  // High byte first
+      "ee.vst.128.ip q1, %0, 16\n\t"
+      "ee.vst.128.ip q0, %0, 16\n\t"
+      : "+r"(half)
+      :
+      : "memory");
+  }
+  samples &= 15;
+#endif
+  // Align to a word boundary, the caller's buffer only needs 16 bit alignment
+  if (samples && (reinterpret_cast<uintptr_t>(half) & 3)) {
+    *half = (uint16_t)((*half << 8) | (*half >> 8));
+    half++;
+    samples--;
+  }
+  uint32_t* words = reinterpret_cast<uint32_t*>(half);
+  size_t count = samples / 2;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t w = __builtin_bswap32(words[i]);
+    words[i] = (w >> 16) | (w << 16);  // Put the samples back in order
+  }
+  if (samples & 1) {
+    half += samples - 1;
+    *half = (uint16_t)((*half << 8) | (*half >> 8));
+  }
+}
+
+/**
+ * @brief Encodes samples as G.711 in place, byte i holds sample i afterwards.
+ *
+ * @param data The samples.
+ * @param samples Number of samples.
+ * @param aLaw true for A-law (PCMA), false for mu-law (PCMU).
+ */
+void RTSPServer::encodeG711(int16_t* data, size_t samples, bool aLaw) {
+  uint8_t* out = reinterpret_cast<uint8_t*>(data);
+  if (aLaw) {
+    for (size_t i = 0; i < samples; i++) {
+      out[i] = encodeALaw(data[i]);
+    }
+  } else {
+    for (size_t i = 0; i < samples; i++) {
+      out[i] = encodeULaw(data[i]);
+    }
+  }
+}
+
+/**
+ * @brief Encodes samples as DVI4 (IMA ADPCM) in place.
+ *
+ * The output is split into blocks of blockLen bytes, each starting with the RFC 3551
+ * DVI4 header (predicted value and step index) written to headers. Samples are
+ * packed two per byte with the first sample in the high nibble. The encoder state
+ * carries over to the next call.
+ *
+ * @param data The samples, an odd last sample is dropped.
+ * @param samples Number of samples.
+ * @param blockLen Encoded bytes per packet.
+ * @param headers Receives a 4 byte header per block.
+ * @return Number of encoded bytes.
+ */
+size_t RTSPServer::encodeDvi4(int16_t* data, size_t samples, size_t blockLen, std::vector<uint8_t>& headers) {
+  uint8_t* out = reinterpret_cast<uint8_t*>(data);
+  size_t len = samples / 2;
+  headers.clear();
+  for (size_t i = 0; i < len; i++) {
+    if (i % blockLen == 0) {
+      headers.push_back((this->adpcmPredictor >> 8) & 0xFF);
+      headers.push_back(this->adpcmPredictor & 0xFF);
+      headers.push_back(this->adpcmIndex);
+      headers.push_back(0);
+    }
+    uint8_t high = encodeIma(data[2 * i], this->adpcmPredictor, this->adpcmIndex);
+    uint8_t low = encodeIma(data[2 * i + 1], this->adpcmPredictor, this->adpcmIndex);
+    out[i] = (high << 4) | low;
+  }
+  return len;
+}
+
+/**
+ * @brief RTP payload type for the audio codec and sample rate.
+ */
+uint8_t RTSPServer::audioPayloadType() const {
+  switch (this->audioCodec) {
+    case AUDIO_PCMU:
+      return (this->sampleRate == 8000) ? 0 : 97;
+    case AUDIO_PCMA:
+      return (this->sampleRate == 8000) ? 8 : 97;
+    case AUDIO_DVI4:
+      switch (this->sampleRate) {
+        case 8000: return 5;
+        case 16000: return 6;
+        case 11025: return 16;
+        case 22050: return 17;
+        default: return 97;
+      }
+    case AUDIO_L16:
+    default:
+      return 97;
+  }
+}
+
+/**
+ * @brief Encoding name of the audio codec for the SDP rtpmap.
+ */
+const char* RTSPServer::audioEncodingName() const {
+  switch (this->audioCodec) {
+    case AUDIO_PCMU: return "PCMU";
+    case AUDIO_PCMA: return "PCMA";
+    case AUDIO_DVI4: return "DVI4";
+    case AUDIO_L16:
+    default: return "L16";
+  }
+}
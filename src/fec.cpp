@@ -0,0 +1,131 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief XORs src into dst, a 32 bit word at a time once dst is aligned.
+ */
+static void xorBytes(uint8_t* dst, const uint8_t* src, size_t len) {
+  while (len && (reinterpret_cast<uintptr_t>(dst) & 3)) {
+    *dst++ ^= *src++;
+    len--;
+  }
+  uint32_t* dstWords = reinterpret_cast<uint32_t*>(dst);
+  size_t words = len / 4;
+  if ((reinterpret_cast<uintptr_t>(src) & 3) == 0) {
+    const uint32_t* srcWords = reinterpret_cast<const uint32_t*>(src);
+    for (size_t i = 0; i < words; i++) {
+      dstWords[i] ^= srcWords[i];
+    }
+  } else {
+    // Camera buffers are only byte aligned, assemble the words in little-endian order
+    for (size_t i = 0; i < words; i++) {
+      const uint8_t* p = src + i * 4;
+      dstWords[i] ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+  }
+  dst += words * 4;
+  src += words * 4;
+  for (size_t i = 0; i < (len & 3); i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+/**
+ * @brief Adds a sent packet to the current ULPFEC group.
+ *
+ * @param packet The packet as packetized.
+ * @param sequenceNumber The sequence number it was sent with.
+ * @param timestampOffset The timestamp offset of the track.
+ */
+void RTSPServer::addFecPacket(const RTP_Packet& packet, uint16_t sequenceNumber, uint32_t timestampOffset) {
+  RTP_FecState& fec = this->videoFec;
+  if (fec.payload == NULL) {
+    fec.payload = (uint8_t*)malloc(udpMaxPayload());
+    if (fec.payload == NULL) {
+      RTSP_LOGE(LOG_TAG, "Failed to allocate FEC buffer");
+      return;
+    }
+  }
+
+  const uint8_t* rtp = packet.header + RTP_TCP_PREFIX_SIZE;
+  size_t headerLen = packet.headerLen - RTP_TCP_PREFIX_SIZE - RTP_HEADER_SIZE; // Payload header after the RTP header
+  size_t len = headerLen + packet.headerExtLen + packet.payloadLen;
+  if (len > udpMaxPayload()) {
+    return;
+  }
+  uint32_t timestamp = (uint32_t)rtp[4] << 24 | (uint32_t)rtp[5] << 16 | (uint32_t)rtp[6] << 8 | rtp[7];
+
+  if (fec.count == 0) {
+    fec.sequenceBase = sequenceNumber;
+    fec.protectionLength = 0;
+    fec.lengthRecovery = 0;
+    fec.timestampRecovery = 0;
+    fec.byteRecovery = 0;
+  }
+  if (len > fec.protectionLength) {
+    memset(fec.payload + fec.protectionLength, 0, len - fec.protectionLength); // Shorter packets are zero padded
+    fec.protectionLength = len;
+  }
+
+  xorBytes(fec.payload, rtp + RTP_HEADER_SIZE, headerLen);
+  xorBytes(fec.payload + headerLen, packet.headerExt, packet.headerExtLen);
+  xorBytes(fec.payload + headerLen + packet.headerExtLen, packet.payload, packet.payloadLen);
+  fec.byteRecovery ^= rtp[1];
+  fec.lengthRecovery ^= len;
+  fec.timestampRecovery ^= timestamp + timestampOffset;
+  fec.timestamp = timestamp;
+  fec.count++;
+}
+
+/**
+ * @brief Sends the RFC 5109 parity packet of the current group and starts a new group.
+ *
+ * Parity goes out as a separate stream with its own SSRC, sequence numbers and
+ * port, so receivers that do not use it see no gaps in the video stream. A
+ * receiver that does can rebuild any one lost packet of the group from it.
+ */
+void RTSPServer::sendFecPacket(int rtpSocket) {
+  RTP_FecState& fec = this->videoFec;
+  if (fec.count == 0) {
+    return;
+  }
+
+  uint8_t* header = fec.header;
+  uint16_t mask = (uint16_t)(0xFFFF << (RTP_FEC_MAX_GROUP - fec.count)); // First packet in the most significant bit
+  header[0] = 0; // E, L and the P, X, CC recovery, all zero for our packets
+  header[1] = fec.byteRecovery; // Marker and payload type recovery
+  header[2] = (fec.sequenceBase >> 8) & 0xFF;
+  header[3] = fec.sequenceBase & 0xFF;
+  header[4] = (fec.timestampRecovery >> 24) & 0xFF;
+  header[5] = (fec.timestampRecovery >> 16) & 0xFF;
+  header[6] = (fec.timestampRecovery >> 8) & 0xFF;
+  header[7] = fec.timestampRecovery & 0xFF;
+  header[8] = (fec.lengthRecovery >> 8) & 0xFF;
+  header[9] = fec.lengthRecovery & 0xFF;
+  header[10] = (fec.protectionLength >> 8) & 0xFF; // Level 0 header
+  header[11] = fec.protectionLength & 0xFF;
+  header[12] = (mask >> 8) & 0xFF;
+  header[13] = mask & 0xFF;
+
+  RTP_Packet packet;
+  int RtpPacketSize = RTP_HEADER_SIZE + RTP_FEC_HEADER_SIZE + fec.protectionLength;
+  packet.header[0] = '$';
+  packet.header[1] = 0;
+  packet.header[2] = (RtpPacketSize >> 8) & 0xFF;
+  packet.header[3] = RtpPacketSize & 0xFF;
+  packet.header[4] = 0x80; // Version: 2, Padding: 0, Extension: 0, CSRC Count: 0
+  packet.header[5] = RTP_FEC_PAYLOAD_TYPE;
+  packet.header[6] = 0; // Sequence Number, set per session
+  packet.header[7] = 0;
+  packet.header[8] = (fec.timestamp >> 24) & 0xFF;
+  packet.header[9] = (fec.timestamp >> 16) & 0xFF;
+  packet.header[10] = (fec.timestamp >> 8) & 0xFF;
+  packet.header[11] = fec.timestamp & 0xFF;
+  packet.headerLen = RTP_TCP_PREFIX_SIZE + RTP_HEADER_SIZE;
+  packet.headerExt = header;
+  packet.headerExtLen = RTP_FEC_HEADER_SIZE;
+  packet.payload = fec.payload;
+  packet.payloadLen = fec.protectionLength;
+  sendRtpPacket(packet, this->fecMulticastTrack, rtpSocket, false);
+
+  fec.count = 0;
+}
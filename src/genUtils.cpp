@@ -15,29 +15,17 @@ void RTSPServer::startSubtitlesTimer(esp_timer_cb_t userCallback) {
 }
 
 void RTSPServer::setMaxClients(uint8_t newMaxClients) {
-  if (xSemaphoreTake(maxClientsMutex, portMAX_DELAY) == pdTRUE) {
-    if (newMaxClients <= MAX_CLIENTS) {
-      this->maxClients = newMaxClients;
-      RTSP_LOGI(LOG_TAG, "Max clients updated to: %d", this->maxClients);
-    } else {
-      RTSP_LOGW(LOG_TAG, "Requested max clients (%d) exceeds the hardcoded limit (%d). Max clients set to %d.", newMaxClients, MAX_CLIENTS, MAX_CLIENTS);
-      this->maxClients = MAX_CLIENTS;
-    }
-    xSemaphoreGive(maxClientsMutex);
+  if (newMaxClients <= MAX_CLIENTS) {
+    this->maxClients = newMaxClients;
+    RTSP_LOGI(LOG_TAG, "Max clients updated to: %d", newMaxClients);
   } else {
-    RTSP_LOGE(LOG_TAG, "Failed to acquire maxClients mutex");
+    RTSP_LOGW(LOG_TAG, "Requested max clients (%d) exceeds the hardcoded limit (%d). Max clients set to %d.", newMaxClients, MAX_CLIENTS, MAX_CLIENTS);
+    this->maxClients = MAX_CLIENTS;
   }
 }
 
 uint8_t RTSPServer::getMaxClients() {
-  uint8_t clients = 0;
-  if (xSemaphoreTake(maxClientsMutex, portMAX_DELAY) == pdTRUE) {
-    clients = this->maxClients;
-    xSemaphoreGive(maxClientsMutex);
-  } else {
-    RTSP_LOGE(LOG_TAG, "Failed to acquire maxClients mutex");
-  }
-  return clients;
+  return this->maxClients;
 }
 
 void RTSPServer::incrementActiveRTSPClients() {
@@ -63,28 +51,142 @@ uint8_t RTSPServer::getActiveRTSPClients() {
 }
 
 void RTSPServer::updateIsPlayingStatus() {
-  bool anyClientStreaming = false;
-  for (const auto& sessionPair : sessions) {
-    if (sessionPair.second.isPlaying) {
-      anyClientStreaming = true;
-      break;
+  setIsPlaying(publishPlayingList() > 0);
+}
+
+/**
+ * @brief Publishes the list of playing sessions read by the sender tasks.
+ *
+ * The list is rebuilt in the spare buffer and swapped in atomically, then the
+ * call waits until no sender uses the previous list. After it returns, no
+ * sender touches a session that stopped playing, so its slot can be freed.
+ *
+ * @return Number of playing sessions.
+ */
+uint8_t RTSPServer::publishPlayingList() {
+  RTSP_PlayingList* current = this->playingList.load(std::memory_order_acquire);
+  RTSP_PlayingList* next = current == &this->playingLists[0] ? &this->playingLists[1] : &this->playingLists[0];
+  while (next->readers.load(std::memory_order_acquire) != 0) {
+    vTaskDelay(1);
+  }
+
+  // Unicast sessions first, then one multicast session as they share one stream
+  uint8_t count = 0;
+  RTSP_Session* multicast = NULL;
+  for (RTSP_Session& session : this->sessions) {
+    if (!session.isPlaying) continue;
+    if (!session.isMulticast) {
+      next->sessions[count++] = &session;
+    } else if (multicast == NULL) {
+      multicast = &session;
     }
   }
-  setIsPlaying(anyClientStreaming);
+  if (multicast) {
+    next->sessions[count++] = multicast;
+  }
+  next->count = count;
+  this->playingList.store(next, std::memory_order_release);
+
+  while (current->readers.load(std::memory_order_acquire) != 0) {
+    vTaskDelay(1);
+  }
+  return count;
+}
+
+/**
+ * @brief Takes a playing session out of the senders' list so rtspTask can change it.
+ *
+ * Senders use a playing session without locking, so its tracks and settings
+ * are only changed while it is not published.
+ *
+ * @return true if the session was playing, pass it to unholdSession() when done.
+ */
+bool RTSPServer::holdSession(RTSP_Session& session) {
+  if (!session.isPlaying) {
+    return false;
+  }
+  session.isPlaying = false;
+  publishPlayingList(); // Returns once no sender uses the session
+  return true;
+}
+
+/**
+ * @brief Publishes a session again after holdSession().
+ */
+void RTSPServer::unholdSession(RTSP_Session& session, bool wasPlaying) {
+  if (wasPlaying) {
+    session.isPlaying = true;
+    publishPlayingList();
+  }
+}
+
+/**
+ * @brief Gets the current list of playing sessions, without locking.
+ *
+ * The list stays valid until releasePlayingList() is called.
+ */
+RTSP_PlayingList* RTSPServer::acquirePlayingList() {
+  while (true) {
+    RTSP_PlayingList* list = this->playingList.load(std::memory_order_acquire);
+    list->readers.fetch_add(1, std::memory_order_acq_rel);
+    if (this->playingList.load(std::memory_order_acquire) == list) {
+      return list;
+    }
+    list->readers.fetch_sub(1, std::memory_order_release); // Replaced meanwhile, take the new one
+  }
+}
+
+void RTSPServer::releasePlayingList(RTSP_PlayingList* list) {
+  list->readers.fetch_sub(1, std::memory_order_release);
+}
+
+/**
+ * @brief Starts a new RTP stream with random sequence number, SSRC and timestamp offset.
+ */
+void RTSPServer::initTrackState(RTP_TrackState& track, uint8_t channel) {
+  track.sequenceNumber = static_cast<uint16_t>(esp_random());
+  track.ssrc = esp_random();
+  track.timestampOffset = esp_random();
+  track.channel = channel;
+  track.packetCount = 0;
+  track.octetCount = 0;
+  track.lastSrUs = 0;
+  track.stats.fractionLost = 0;
+  track.stats.cumulativeLost = 0;
+  track.stats.highestSequence = 0;
+  track.stats.jitter = 0;
+  track.stats.rttUs = 0;
+  track.stats.reports = 0;
+  track.stats.fresh.store(false, std::memory_order_relaxed);
+  track.rtxSequence = static_cast<uint16_t>(esp_random());
+  track.rtxSsrc = esp_random();
+  track.egress = NULL;
+  memset(&track.rtpAddr, 0, sizeof(track.rtpAddr));
+  memset(&track.rtcpAddr, 0, sizeof(track.rtcpAddr));
+}
+
+/**
+ * @brief Converts a media clock time to an RTP timestamp.
+ *
+ * All tracks share the esp_timer microsecond clock. The conversion is exact, so
+ * timestamps never drift however long the stream runs.
+ *
+ * @param captureUs Capture time in microseconds, eg. esp_timer_get_time().
+ * @param clockRate RTP clock rate of the track in Hz.
+ * @return The RTP timestamp, before the per session offset.
+ */
+uint32_t RTSPServer::mediaTimestamp(int64_t captureUs, uint32_t clockRate) const {
+  int64_t seconds = captureUs / 1000000;
+  int64_t micros = captureUs % 1000000;
+  return (uint32_t)(seconds * clockRate + micros * clockRate / 1000000);
 }
 
 void RTSPServer::setIsPlaying(bool playing) {
-    xSemaphoreTake(isPlayingMutex, portMAX_DELAY);
-    this->isPlaying = playing;
-    xSemaphoreGive(isPlayingMutex);
+  this->isPlaying = playing;
 }
 
 bool RTSPServer::getIsPlaying() const {
-    bool playing;
-    xSemaphoreTake(isPlayingMutex, portMAX_DELAY);
-    playing = this->isPlaying;
-    xSemaphoreGive(isPlayingMutex);
-    return playing;
+  return this->isPlaying;
 }
 
 bool RTSPServer::readyToSendFrame() const {
@@ -99,50 +201,52 @@ bool RTSPServer::readyToSendSubtitles() const {
   return getIsPlaying() && this->rtpSubtitlesSent;
 }
 
-int RTSPServer::captureCSeq(char* request) {
-  char* cseqStr = strstr(request, "CSeq: ");
-  if (cseqStr == NULL) {
-    return -1;
-  }
-  cseqStr += 6;
-  char* endOfLine = strchr(cseqStr, '\n');
-  if (endOfLine) {
-    *endOfLine = 0;
-  }
-  int cseq = atoi(cseqStr);
-  if (endOfLine) {
-    *endOfLine = '\n';
-  }
-  return cseq;
-}
-
-uint32_t RTSPServer::generateSessionID() {
-  return esp_random();
+/**
+ * @brief Generates a random session ID that also encodes the session's slot.
+ */
+uint32_t RTSPServer::generateSessionID(uint8_t slot) {
+  uint32_t sessionID;
+  do {
+    sessionID = (esp_random() & ~RTSP_SESSION_SLOT_MASK) | slot;
+  } while (sessionID == 0);
+  return sessionID;
 }
 
-uint32_t RTSPServer::extractSessionID(char* request) {
-  char* sessionStr = strstr(request, "Session: ");
-  if (sessionStr == NULL) {
-    return 0;
+/**
+ * @brief Finds a session by its ID, the slot is read from the ID.
+ *
+ * @return The session, or NULL if there is none with this ID.
+ */
+RTSP_Session* RTSPServer::findSession(uint32_t sessionID) {
+  uint32_t slot = sessionID & RTSP_SESSION_SLOT_MASK;
+  if (slot >= MAX_CLIENTS || !this->sessions[slot].inUse || this->sessions[slot].sessionID != sessionID) {
+    return NULL;
   }
-  sessionStr += 9;
-  char* endOfLine = strchr(sessionStr, '\n');
-  if (endOfLine) {
-    *endOfLine = 0;
-  }
-
-  while (isspace(*sessionStr)) sessionStr++;
-  char* end = sessionStr + strlen(sessionStr) - 1;
-  while (end > sessionStr && isspace(*end)) end--;
-  *(end + 1) = 0;
+  return &this->sessions[slot];
+}
 
-  uint32_t sessionID = strtoul(sessionStr, NULL, 10);
+/**
+ * @brief Frees the slot of a disconnected session.
+ */
+void RTSPServer::freeSession(RTSP_Session& session) {
+  session.isPlaying = false;
+  freeHistory(session.videoTrack);
+  stopEgressQueue(this->egressQueues[&session - this->sessions]);
+  session.sock = -1;
+  session.sessionCookie[0] = '\0';
+  session.cookieHash = 0;
+  session.inUse = false;
+}
 
-  if (endOfLine) {
-    *endOfLine = '\n';
+/**
+ * @brief FNV-1a hash of a session cookie, compared before the cookie itself.
+ */
+uint32_t RTSPServer::hashCookie(const char* cookie) {
+  uint32_t hash = 2166136261u;
+  while (*cookie) {
+    hash = (hash ^ (uint8_t)*cookie++) * 16777619u;
   }
-
-  return sessionID;
+  return hash;
 }
 
 const char* RTSPServer::dateHeader() {
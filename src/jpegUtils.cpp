@@ -0,0 +1,186 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Parses the JPEG headers of a baseline frame for RFC 2435 packetization.
+ *
+ * Finds the entropy coded scan data and reads the frame size, the sampling
+ * (RTP/JPEG type) and the luma/chroma quantization tables from the headers.
+ *
+ * @param data The JPEG file.
+ * @param len Length of the JPEG file.
+ * @param jpeg Filled with the parsed information.
+ * @return true if the frame can be sent as RFC 2435 payload, false otherwise.
+ */
+bool RTSPServer::parseJpeg(const uint8_t* data, size_t len, JPEG_Info& jpeg) {
+  memset(&jpeg, 0, sizeof(jpeg));
+
+  if (len < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+    RTSP_LOGD(LOG_TAG, "JPEG SOI marker not found");
+    return false;
+  }
+
+  const uint8_t* qTables[4] = { NULL, NULL, NULL, NULL };
+  uint8_t lumaTable = 0;
+  uint8_t chromaTable = 1;
+  bool haveFrame = false;
+  size_t pos = 2;
+
+  while (pos + 4 <= len) {
+    if (data[pos] != 0xFF) {
+      RTSP_LOGD(LOG_TAG, "Invalid JPEG marker at %u", pos);
+      return false;
+    }
+    uint8_t marker = data[pos + 1];
+    if (marker == 0xFF) { // Fill byte
+      pos++;
+      continue;
+    }
+    size_t segmentLen = (data[pos + 2] << 8) | data[pos + 3];
+    const uint8_t* segment = data + pos + 4;
+    if (segmentLen < 2 || pos + 2 + segmentLen > len) {
+      RTSP_LOGD(LOG_TAG, "Truncated JPEG segment 0x%02X", marker);
+      return false;
+    }
+    segmentLen -= 2;
+
+    switch (marker) {
+      case 0xDB: { // DQT, may hold several tables
+        size_t i = 0;
+        while (i < segmentLen) {
+          uint8_t precision = segment[i] >> 4;
+          uint8_t id = segment[i] & 0x0F;
+          if (precision != 0 || id > 3 || i + 65 > segmentLen) {
+            RTSP_LOGD(LOG_TAG, "Unsupported JPEG quantization table");
+            return false;
+          }
+          qTables[id] = segment + i + 1;
+          i += 65;
+        }
+        break;
+      }
+      case 0xC0: { // SOF0, baseline only
+        if (segmentLen < 15 || segment[5] != 3) {
+          RTSP_LOGD(LOG_TAG, "Unsupported JPEG frame, only 3 component baseline is supported");
+          return false;
+        }
+        jpeg.height = (segment[1] << 8) | segment[2];
+        jpeg.width = (segment[3] << 8) | segment[4];
+        uint8_t lumaSampling = segment[7];
+        lumaTable = segment[8];
+        chromaTable = segment[11];
+        if (segment[10] != 0x11 || segment[13] != 0x11 || segment[14] != chromaTable) {
+          RTSP_LOGD(LOG_TAG, "Unsupported JPEG chroma sampling");
+          return false;
+        }
+        if (lumaSampling == 0x21) {
+          jpeg.type = 0; // 4:2:2
+        } else if (lumaSampling == 0x22) {
+          jpeg.type = 1; // 4:2:0
+        } else {
+          RTSP_LOGD(LOG_TAG, "Unsupported JPEG luma sampling 0x%02X", lumaSampling);
+          return false;
+        }
+        haveFrame = true;
+        break;
+      }
+      case 0xDD: { // DRI
+        if (segmentLen < 2) {
+          RTSP_LOGD(LOG_TAG, "Invalid JPEG restart interval");
+          return false;
+        }
+        jpeg.restartInterval = (segment[0] << 8) | segment[1];
+        break;
+      }
+      case 0xC1: case 0xC2: case 0xC3: case 0xC5: case 0xC6: case 0xC7:
+      case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+        RTSP_LOGD(LOG_TAG, "Unsupported JPEG frame type 0x%02X", marker);
+        return false;
+      case 0xDA: { // SOS, the entropy coded data follows the header
+        if (!haveFrame || lumaTable > 3 || chromaTable > 3 || !qTables[lumaTable] || !qTables[chromaTable]) {
+          RTSP_LOGD(LOG_TAG, "JPEG scan without frame or quantization tables");
+          return false;
+        }
+        if (jpeg.width == 0 || jpeg.height == 0 || jpeg.width > 2040 || jpeg.height > 2040) {
+          RTSP_LOGD(LOG_TAG, "JPEG size %ux%u can not be sent as RTP/JPEG", jpeg.width, jpeg.height);
+          return false;
+        }
+        size_t scanStart = pos + 2 + segmentLen + 2;
+        size_t scanEnd = len;
+        // Drop the EOI marker and any padding after it
+        while (scanEnd >= scanStart + 2 && !(data[scanEnd - 2] == 0xFF && data[scanEnd - 1] == 0xD9)) {
+          scanEnd--;
+        }
+        if (scanEnd < scanStart + 2) {
+          RTSP_LOGD(LOG_TAG, "JPEG EOI marker not found");
+          return false;
+        }
+        jpeg.scanData = data + scanStart;
+        jpeg.scanLen = scanEnd - 2 - scanStart;
+        jpeg.qTables[0] = qTables[lumaTable];
+        jpeg.qTables[1] = qTables[chromaTable];
+        return true;
+      }
+      default: // APPn, COM, DHT (RFC 2435 uses the standard Huffman tables)
+        break;
+    }
+    pos += 2 + segmentLen + 2;
+  }
+
+  RTSP_LOGD(LOG_TAG, "JPEG SOS marker not found");
+  return false;
+}
+
+/**
+ * @brief Updates the RFC 2435 quantization table header from a parsed frame.
+ *
+ * The tables are sent in-band with a Q value of 128-254. A new Q value is used
+ * whenever the tables change so receivers never use stale cached tables.
+ *
+ * @param jpeg The parsed frame.
+ * @return true if the tables need to be sent with this frame.
+ */
+bool RTSPServer::updateQTables(const JPEG_Info& jpeg) {
+  uint8_t* tables = this->qTableHeader + 4;
+  bool changed = this->jpegQ < 128 || memcmp(tables, jpeg.qTables[0], 64) != 0 || memcmp(tables + 64, jpeg.qTables[1], 64) != 0;
+  if (changed) {
+    memcpy(tables, jpeg.qTables[0], 64);
+    memcpy(tables + 64, jpeg.qTables[1], 64);
+    this->qTableHeader[0] = 0; // MBZ
+    this->qTableHeader[1] = 0; // Precision, 8 bit tables
+    this->qTableHeader[2] = 0; // Length high byte
+    this->qTableHeader[3] = 128; // Length low byte
+    this->jpegQ = (this->jpegQ >= 128 && this->jpegQ < 254) ? this->jpegQ + 1 : 128;
+    RTSP_LOGD(LOG_TAG, "JPEG quantization tables changed, using Q %d", this->jpegQ);
+  }
+
+  uint32_t now = millis();
+  if (changed || this->qTablesPending || now - this->lastQTablesTime >= 1000) {
+    this->qTablesPending = false;
+    this->lastQTablesTime = now;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Finds the start of the next restart interval in JPEG scan data.
+ *
+ * @param data The scan data.
+ * @param len Length of the scan data.
+ * @param offset Offset to search from.
+ * @return The offset just after the next RSTn marker, or len if there is none.
+ */
+size_t RTSPServer::findNextRestart(const uint8_t* data, size_t len, size_t offset) {
+  while (offset + 1 < len) {
+    const uint8_t* marker = (const uint8_t*)memchr(data + offset, 0xFF, len - offset - 1);
+    if (marker == NULL) {
+      break;
+    }
+    offset = marker - data;
+    if (data[offset + 1] >= 0xD0 && data[offset + 1] <= 0xD7) {
+      return offset + 2;
+    }
+    offset++;
+  }
+  return len;
+}
@@ -29,21 +29,481 @@ void RTSPServer::checkAndSetupUDP(int& rtpSocket, bool isMulticast, uint16_t rtp
   }
 }
 
-void RTSPServer::sendTcpPacket(const uint8_t* packet, size_t packetSize, int sock) {
+/**
+ * @brief The multicast group address in network byte order.
+ */
+uint32_t RTSPServer::multicastDestinationIp() const {
+  return htonl((uint32_t)this->rtpIp[0] << 24 | (uint32_t)this->rtpIp[1] << 16 | (uint32_t)this->rtpIp[2] << 8 | this->rtpIp[3]);
+}
+
+/**
+ * @brief Finds the IP address a unicast UDP client's packets go to.
+ *
+ * Called once on SETUP, the senders use the address cached in the track.
+ *
+ * @return The address in network byte order, or 0 if it is not known.
+ */
+uint32_t RTSPServer::clientDestinationIp(const RTSP_Session& session) {
+  struct sockaddr_in peer;
+  socklen_t peerLen = sizeof(peer);
+  if (getpeername(session.sock, (struct sockaddr*)&peer, &peerLen) < 0) {
+    RTSP_LOGE(LOG_TAG, "Failed to get client address");
+    return 0;
+  }
+  return peer.sin_addr.s_addr;
+}
+
+/**
+ * @brief Sets the UDP addresses of a track, RTCP goes to the port after RTP.
+ *
+ * @param track The track to send to the address.
+ * @param ip The IP address in network byte order, 0 leaves the track without one.
+ * @param port The RTP port.
+ */
+void RTSPServer::setTrackDestination(RTP_TrackState& track, uint32_t ip, uint16_t port) {
+  memset(&track.rtpAddr, 0, sizeof(track.rtpAddr));
+  memset(&track.rtcpAddr, 0, sizeof(track.rtcpAddr));
+  if (ip == 0 || port == 0) {
+    return;
+  }
+  track.rtpAddr.sin_family = AF_INET;
+  track.rtpAddr.sin_addr.s_addr = ip;
+  track.rtpAddr.sin_port = htons(port);
+  track.rtcpAddr = track.rtpAddr;
+  track.rtcpAddr.sin_port = htons(port + 1);
+}
+
+/**
+ * @brief Size of a new queue, an eighth of RTSP_TCP_QUEUE_SIZE without PSRAM.
+ */
+static size_t egressQueueBaseSize() {
+  return psramFound() ? RTSP_TCP_QUEUE_SIZE : RTSP_TCP_QUEUE_SIZE / 8;
+}
+
+/**
+ * @brief Most a queue grows to, an eighth of RTSP_TCP_QUEUE_MAX without PSRAM.
+ */
+static size_t egressQueueMaxSize() {
+  return psramFound() ? RTSP_TCP_QUEUE_MAX : RTSP_TCP_QUEUE_MAX / 8;
+}
+
+static uint8_t* allocEgressBuffer(size_t size) {
+  return (uint8_t*)(psramFound() ? ps_malloc(size) : malloc(size));
+}
+
+/**
+ * @brief Splits a queue's buffer into one empty ring per priority class.
+ *
+ * Audio and data get a quarter of the base size each, video gets the rest,
+ * which grows with the buffer.
+ */
+static void layoutEgressQueue(RTSP_EgressQueue& queue) {
+  size_t classSize = egressQueueBaseSize() / 4;
+  uint8_t* ringBuffer = queue.buffer;
+  for (int i = 0; i < RTSP_EGRESS_CLASSES; i++) {
+    RTSP_EgressRing& ring = queue.rings[i];
+    ring.buffer = ringBuffer;
+    ring.size = i == RTSP_EGRESS_VIDEO ? queue.size - classSize * (RTSP_EGRESS_CLASSES - 1) : classSize;
+    ring.head = 0;
+    ring.len = 0;
+    ringBuffer += ring.size;
+  }
+  queue.len = 0;
+  queue.remaining = 0;
+}
+
+/**
+ * @brief Starts queueing the interleaved packets of a TCP or HTTP session.
+ *
+ * The buffer is allocated on the first use of the slot and kept for later
+ * connections. It is split into one ring per priority class, video gets
+ * most of it.
+ *
+ * @param queue The queue of the session's slot.
+ * @param sock The socket the packets go to.
+ */
+void RTSPServer::startEgressQueue(RTSP_EgressQueue& queue, int sock) {
+  if (xSemaphoreTake(sendTcpMutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+  if (queue.buffer == NULL) {
+    queue.size = egressQueueBaseSize();
+    queue.buffer = allocEgressBuffer(queue.size);
+    if (queue.buffer == NULL) {
+      RTSP_LOGE(LOG_TAG, "Failed to allocate TCP send queue, sends will block");
+    }
+  }
+  layoutEgressQueue(queue);
+  queue.active = 0;
+  queue.sock = sock;
+  queue.progressUs = esp_timer_get_time();
+  queue.backlogSinceUs = 0;
+  queue.droppedPackets = 0;
+  queue.skippedFrames = 0;
+  queue.evicted = false;
+  xSemaphoreGive(sendTcpMutex);
+}
+
+/**
+ * @brief Drops everything queued, must be called with sendTcpMutex held.
+ */
+static void clearEgressQueue(RTSP_EgressQueue& queue) {
+  for (int i = 0; i < RTSP_EGRESS_CLASSES; i++) {
+    queue.rings[i].head = 0;
+    queue.rings[i].len = 0;
+  }
+  queue.len = 0;
+  queue.remaining = 0;
+}
+
+/**
+ * @brief Stops queueing for a slot, dropping anything not yet written.
+ *
+ * A queue grown for large frames goes back to the base size, so the memory
+ * is only held while the client that needed it is connected.
+ */
+void RTSPServer::stopEgressQueue(RTSP_EgressQueue& queue) {
+  if (xSemaphoreTake(sendTcpMutex, portMAX_DELAY) == pdTRUE) {
+    if (queue.droppedPackets || queue.skippedFrames) {
+      RTSP_LOGW(LOG_TAG, "Skipped %lu frames and dropped %lu packets for a slow TCP client", (unsigned long)queue.skippedFrames, (unsigned long)queue.droppedPackets);
+    }
+    clearEgressQueue(queue);
+    queue.sock = -1;
+    if (queue.buffer != NULL && queue.size > egressQueueBaseSize()) {
+      free(queue.buffer);
+      queue.size = egressQueueBaseSize();
+      queue.buffer = allocEgressBuffer(queue.size); // NULL is allocated again by startEgressQueue
+      if (queue.buffer != NULL) {
+        layoutEgressQueue(queue);
+      }
+    }
+    xSemaphoreGive(sendTcpMutex);
+  }
+}
+
+/**
+ * @brief Copies bytes to the end of a ring, the caller checks there is room.
+ */
+static void ringWrite(RTSP_EgressRing& ring, const uint8_t* data, size_t len) {
+  size_t tail = (ring.head + ring.len) % ring.size;
+  while (len > 0) {
+    size_t chunk = ring.size - tail < len ? ring.size - tail : len;
+    memcpy(ring.buffer + tail, data, chunk);
+    tail = (tail + chunk) % ring.size;
+    data += chunk;
+    len -= chunk;
+    ring.len += chunk;
+  }
+}
+
+/**
+ * @brief Removes bytes from the start of a ring, copying them out if data is not NULL.
+ */
+static void ringRead(RTSP_EgressRing& ring, uint8_t* data, size_t len) {
+  while (len > 0) {
+    size_t chunk = ring.size - ring.head < len ? ring.size - ring.head : len;
+    if (data) {
+      memcpy(data, ring.buffer + ring.head, chunk);
+      data += chunk;
+    }
+    ring.head = (ring.head + chunk) % ring.size;
+    ring.len -= chunk;
+    len -= chunk;
+  }
+}
+
+/**
+ * @brief Writes as much of a queue as its socket takes without blocking.
+ *
+ * Packets go out one at a time, the next one from the highest priority
+ * class that has any. A packet that was started is always finished first,
+ * so audio waits for at most one video packet rather than a whole frame.
+ * Must be called with sendTcpMutex held.
+ */
+void RTSPServer::drainEgressQueue(RTSP_EgressQueue& queue) {
+  while (queue.len > 0) {
+    if (queue.remaining == 0) {
+      uint8_t next = 0;
+      while (queue.rings[next].len == 0) {
+        next++;
+      }
+      uint32_t packetLen;
+      ringRead(queue.rings[next], (uint8_t*)&packetLen, RTSP_EGRESS_RECORD_SIZE);
+      queue.len -= RTSP_EGRESS_RECORD_SIZE;
+      queue.active = next;
+      queue.remaining = packetLen;
+    }
+
+    RTSP_EgressRing& ring = queue.rings[queue.active];
+    size_t first = ring.size - ring.head;
+    if (first > queue.remaining) {
+      first = queue.remaining;
+    }
+    struct iovec iov[2];
+    iov[0].iov_base = ring.buffer + ring.head;
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring.buffer;
+    iov[1].iov_len = queue.remaining - first;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+    ssize_t result = sendmsg(queue.sock, &msg, MSG_DONTWAIT);
+    if (result <= 0) {
+      if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        clearEgressQueue(queue); // The connection is gone, rtspTask closes it
+      }
+      break;
+    }
+    ringRead(ring, NULL, result);
+    queue.len -= result;
+    queue.remaining -= result;
+    queue.progressUs = esp_timer_get_time();
+  }
+  if (queue.len == 0 && queue.backlogSinceUs) {
+    // Time the client was behind tells the rate controller the link is slow
+    this->rateTcpWaitUs.fetch_add(esp_timer_get_time() - queue.backlogSinceUs, std::memory_order_relaxed);
+    queue.backlogSinceUs = 0;
+  }
+}
+
+/**
+ * @brief Checks if a queue has held data longer than tcpSendDeadlineMs.
+ */
+bool RTSPServer::egressQueueLate(const RTSP_EgressQueue& queue, int64_t now) const {
+  return queue.len > 0 && now - queue.progressUs > (int64_t)this->tcpSendDeadlineMs * 1000;
+}
+
+/**
+ * @brief Grows a queue so its video ring holds a frame, must be called with sendTcpMutex held.
+ *
+ * Only an empty queue is grown, its contents are not kept, and never past
+ * egressQueueMaxSize().
+ *
+ * @param videoLen Bytes the video ring must hold, including the length records.
+ * @return true if the video ring is now large enough.
+ */
+static bool growEgressQueue(RTSP_EgressQueue& queue, size_t videoLen) {
+  if (queue.len > 0 || queue.remaining > 0) {
+    return false;
+  }
+  size_t size = queue.size - queue.rings[RTSP_EGRESS_VIDEO].size + (videoLen + 4095) / 4096 * 4096;
+  if (size > egressQueueMaxSize()) {
+    RTSP_LOGD(LOG_TAG, "A %u byte frame is over RTSP_TCP_QUEUE_MAX, skipping it", (unsigned)videoLen);
+    return false;
+  }
+  uint8_t* buffer = allocEgressBuffer(size);
+  if (buffer == NULL) {
+    RTSP_LOGW(LOG_TAG, "No memory to queue a %u byte frame, skipping it", (unsigned)videoLen);
+    return false;
+  }
+  free(queue.buffer);
+  queue.buffer = buffer;
+  queue.size = size;
+  layoutEgressQueue(queue);
+  return true;
+}
+
+/**
+ * @brief Checks at a frame boundary if a client can take a whole frame.
+ *
+ * The frame must fit in the free space of the video ring after writing what
+ * the socket takes now, so it is never cut short. The ring grows once the
+ * queue is empty if the frame is larger than the whole ring, frames too large
+ * for RTSP_TCP_QUEUE_MAX are always skipped.
+ *
+ * @param queue The client's queue.
+ * @param len Bytes of the frame including the interleaved prefixes.
+ * @param packets Number of packets in the frame.
+ * @return false if the client is behind and should skip the frame.
+ */
+bool RTSPServer::egressQueueFits(RTSP_EgressQueue& queue, size_t len, size_t packets) {
+  if (queue.buffer == NULL) {
+    return true;
+  }
+  bool fits = false;
   if (xSemaphoreTake(sendTcpMutex, portMAX_DELAY) == pdTRUE) {
-    ssize_t sent = 0;
-    while (sent < packetSize) {
-      ssize_t result = send(sock, packet + sent, packetSize - sent, 0);
+    if (!queue.evicted) {
+      drainEgressQueue(queue);
+      len += packets * RTSP_EGRESS_RECORD_SIZE;
+      if (len <= queue.rings[RTSP_EGRESS_VIDEO].size || growEgressQueue(queue, len)) {
+        const RTSP_EgressRing& ring = queue.rings[RTSP_EGRESS_VIDEO];
+        fits = len <= ring.size - ring.len && !egressQueueLate(queue, esp_timer_get_time());
+      }
+    }
+    xSemaphoreGive(sendTcpMutex);
+  }
+  return fits;
+}
+
+/**
+ * @brief Disconnects a client that cannot keep up, under the QUEUE_EVICT policy.
+ *
+ * The socket is shut down rather than closed, rtspTask then sees the
+ * connection end and frees the session as for any disconnect.
+ */
+void RTSPServer::evictEgressClient(RTSP_EgressQueue& queue) {
+  RTSP_LOGW(LOG_TAG, "Evicting TCP client that is %lu ms behind", (unsigned long)((esp_timer_get_time() - queue.progressUs) / 1000));
+  queue.evicted = true;
+  clearEgressQueue(queue);
+  shutdown(queue.sock, SHUT_RDWR);
+}
+
+/**
+ * @brief Writes queued data once the socket is writable and enforces the send deadline.
+ *
+ * Called by rtspTask, so queues drain even when no new packets are sent.
+ */
+void RTSPServer::serviceEgressQueue(RTSP_EgressQueue& queue) {
+  if (xSemaphoreTake(sendTcpMutex, portMAX_DELAY) == pdTRUE) {
+    if (queue.sock >= 0 && queue.buffer != NULL && !queue.evicted) {
+      drainEgressQueue(queue);
+      if (this->tcpQueuePolicy == QUEUE_EVICT && egressQueueLate(queue, esp_timer_get_time())) {
+        evictEgressClient(queue);
+      }
+    }
+    xSemaphoreGive(sendTcpMutex);
+  }
+}
+
+bool RTSPServer::sendTcpPacket(const uint8_t* packet, size_t packetSize, RTSP_EgressQueue& queue, RTSP_EgressClass priority) {
+  struct iovec iov;
+  iov.iov_base = const_cast<uint8_t*>(packet);
+  iov.iov_len = packetSize;
+  return sendTcpPacket(&iov, 1, queue, priority);
+}
+
+/**
+ * @brief Sends an interleaved packet to a TCP client without waiting for it.
+ *
+ * The packet is written at once when nothing is queued for the client.
+ * Otherwise it is queued whole in the ring of its priority class and written
+ * when it is its turn, see drainEgressQueue. A packet that does not fit, or
+ * any packet once the queue is past its deadline, is dropped and the client
+ * is evicted under the QUEUE_EVICT policy. Video frames were checked whole by
+ * egressQueueFits, so the deadline does not cut one short.
+ *
+ * @param priority Class of the packet, audio goes out before queued video.
+ * @return false if the packet was dropped.
+ */
+bool RTSPServer::sendTcpPacket(struct iovec* iov, int iovcnt, RTSP_EgressQueue& queue, RTSP_EgressClass priority) {
+  if (queue.buffer == NULL) {
+    sendTcpPacket(iov, iovcnt, queue.sock);
+    return true;
+  }
+  size_t packetLen = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    packetLen += iov[i].iov_len;
+  }
+
+  if (xSemaphoreTake(sendTcpMutex, portMAX_DELAY) != pdTRUE) {
+    RTSP_LOGE(LOG_TAG, "Failed to acquire mutex");
+    return false;
+  }
+  bool sent = false;
+  if (!queue.evicted) {
+    drainEgressQueue(queue);
+    int64_t now = esp_timer_get_time();
+    RTSP_EgressRing& ring = queue.rings[priority];
+    bool late = priority != RTSP_EGRESS_VIDEO && egressQueueLate(queue, now);
+    if (RTSP_EGRESS_RECORD_SIZE + packetLen <= ring.size - ring.len && !late) {
+      size_t written = 0;
+      if (queue.len == 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t result = sendmsg(queue.sock, &msg, MSG_DONTWAIT);
+        if (result > 0) {
+          written = result;
+        }
+        queue.progressUs = now;
+      }
+      if (written < packetLen) {
+        uint32_t queuedLen = packetLen - written;
+        ringWrite(ring, (const uint8_t*)&queuedLen, RTSP_EGRESS_RECORD_SIZE);
+        queue.len += RTSP_EGRESS_RECORD_SIZE;
+        // Queue the rest, skipping the bytes already written
+        for (int i = 0; i < iovcnt; i++) {
+          size_t len = iov[i].iov_len;
+          if (written >= len) {
+            written -= len;
+            continue;
+          }
+          ringWrite(ring, (const uint8_t*)iov[i].iov_base + written, len - written);
+          written = 0;
+        }
+        queue.len += queuedLen;
+        if (queuedLen < packetLen) {
+          // Partly written, the rest must go out before any other packet
+          ringRead(ring, NULL, RTSP_EGRESS_RECORD_SIZE);
+          queue.len -= RTSP_EGRESS_RECORD_SIZE;
+          queue.active = priority;
+          queue.remaining = queuedLen;
+        }
+        if (queue.backlogSinceUs == 0) {
+          queue.backlogSinceUs = now;
+        }
+        this->rateTcpWaits.fetch_add(1, std::memory_order_relaxed);
+      }
+      sent = true;
+    } else {
+      queue.droppedPackets++;
+      this->rateTcpDrops.fetch_add(1, std::memory_order_relaxed);
+      if (this->tcpQueuePolicy == QUEUE_EVICT) {
+        evictEgressClient(queue);
+      }
+    }
+  }
+  xSemaphoreGive(sendTcpMutex);
+  return sent;
+}
+
+/**
+ * @brief Writes an RTSP response to the client, between interleaved packets and never inside one.
+ */
+void RTSPServer::sendResponse(const RTSP_Session& session, const char* response, size_t len) {
+  int sock = session.isHttp ? session.httpSock : session.sock;
+  RTSP_EgressQueue& queue = this->egressQueues[&session - this->sessions];
+  if (queue.sock == sock && queue.buffer != NULL) {
+    if (!sendTcpPacket((const uint8_t*)response, len, queue, RTSP_EGRESS_DATA)) {
+      RTSP_LOGE(LOG_TAG, "Failed to queue response, the client is too far behind");
+    }
+    return;
+  }
+  write(sock, response, len);
+}
+
+/**
+ * @brief Sends a packet, waiting for the socket as long as it takes.
+ *
+ * Only used when a client's queue could not be allocated.
+ */
+void RTSPServer::sendTcpPacket(struct iovec* iov, int iovcnt, int sock) {
+  if (xSemaphoreTake(sendTcpMutex, portMAX_DELAY) == pdTRUE) {
+    while (iovcnt > 0) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+      ssize_t result = sendmsg(sock, &msg, 0);
       if (result < 0) {
         int err = errno;
         if (err == EAGAIN || err == EWOULDBLOCK) {
           fd_set write_fds;
           FD_ZERO(&write_fds);
           FD_SET(sock, &write_fds);
-          //struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 }; // 100ms
-          int ret = select(sock + 1, NULL, &write_fds, NULL, NULL);
+          // Bounded so a sender never holds a playing list or the mutex forever
+          struct timeval tv = { .tv_sec = this->tcpSendDeadlineMs / 1000, .tv_usec = (this->tcpSendDeadlineMs % 1000) * 1000 };
+          int64_t waitStart = esp_timer_get_time();
+          int ret = select(sock + 1, NULL, &write_fds, NULL, &tv);
+          // The send buffer is full, time blocked here tells the rate controller the link is behind
+          this->rateTcpWaits.fetch_add(1, std::memory_order_relaxed);
+          this->rateTcpWaitUs.fetch_add(esp_timer_get_time() - waitStart, std::memory_order_relaxed);
           if (ret <= 0) {
             RTSP_LOGE(LOG_TAG, "Failed to send TCP packet, select timeout or error");
+            shutdown(sock, SHUT_RDWR); // Part of a packet may be out, rtspTask closes the connection
             break;
           }
           continue;
@@ -54,7 +514,16 @@ void RTSPServer::sendTcpPacket(const uint8_t* packet, size_t packetSize, int soc
           break;
         }
       } else {
-        sent += result;
+        // Skip the segments that were fully sent and trim a partially sent one
+        while (iovcnt > 0 && (size_t)result >= iov->iov_len) {
+          result -= iov->iov_len;
+          iov++;
+          iovcnt--;
+        }
+        if (iovcnt > 0) {
+          iov->iov_base = (uint8_t*)iov->iov_base + result;
+          iov->iov_len -= result;
+        }
       }
     }
     xSemaphoreGive(sendTcpMutex);
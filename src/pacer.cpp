@@ -0,0 +1,175 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Starts a token bucket full.
+ *
+ * The bucket functions only use the time passed in, so the pacing decisions
+ * can be checked on a host against a virtual clock.
+ *
+ * @param bucket The bucket.
+ * @param rate Bytes added per second.
+ * @param burst Most bytes the bucket holds.
+ * @param nowUs Current time in microseconds.
+ */
+void tokenBucketStart(RTP_TokenBucket& bucket, uint32_t rate, uint32_t burst, int64_t nowUs) {
+  bucket.rate = rate;
+  bucket.burst = burst;
+  bucket.tokens = burst;
+  bucket.lastUs = nowUs;
+}
+
+/**
+ * @brief Adds the tokens earned since the last update.
+ */
+static void tokenBucketRefill(RTP_TokenBucket& bucket, int64_t nowUs) {
+  if (nowUs > bucket.lastUs) {
+    bucket.tokens += (nowUs - bucket.lastUs) * bucket.rate / 1000000;
+    if (bucket.tokens > (int64_t)bucket.burst) {
+      bucket.tokens = bucket.burst;
+    }
+    bucket.lastUs = nowUs;
+  }
+}
+
+/**
+ * @brief Time until the bucket allows the next send.
+ *
+ * A send is allowed while the bucket is not empty and may take it below zero,
+ * so packets and frames larger than the burst still get through at the
+ * average rate.
+ *
+ * @return Microseconds to wait, 0 to send now.
+ */
+int64_t tokenBucketDelay(const RTP_TokenBucket& bucket, int64_t nowUs) {
+  if (bucket.rate == 0) {
+    return 0;
+  }
+  int64_t tokens = bucket.tokens + (nowUs > bucket.lastUs ? (nowUs - bucket.lastUs) * bucket.rate / 1000000 : 0);
+  if (tokens > 0) {
+    return 0;
+  }
+  return (-tokens + 1) * 1000000 / bucket.rate + 1;
+}
+
+/**
+ * @brief Takes the tokens for a send.
+ */
+void tokenBucketTake(RTP_TokenBucket& bucket, size_t bytes, int64_t nowUs) {
+  tokenBucketRefill(bucket, nowUs);
+  bucket.tokens -= bytes;
+}
+
+/**
+ * @brief Rate that spreads a frame over a share of the frame interval.
+ *
+ * @param bytes Bytes the frame takes to all UDP receivers.
+ * @param fps Frames sent per second.
+ * @param percent Share of the frame interval to spread the frame over, up to 100.
+ * @return Bytes per second, 0 to not pace.
+ */
+uint32_t framePacingRate(size_t bytes, uint32_t fps, uint8_t percent) {
+  if (fps == 0 || percent == 0 || bytes == 0) {
+    return 0;
+  }
+  if (percent > 100) {
+    percent = 100;
+  }
+  int64_t windowUs = 1000000 / fps * percent / 100;
+  return windowUs > 0 ? (uint32_t)(bytes * 1000000 / windowUs) : 0;
+}
+
+/**
+ * @brief Time to wait before the next packet of a paced frame.
+ *
+ * Waits shorter than RTP_PACE_MIN_WAIT_US are skipped, the bucket goes
+ * further below zero and a later wait is longer by as much.
+ *
+ * @return Microseconds to wait, 0 to send now.
+ */
+int64_t pacingDelay(const RTP_TokenBucket& bucket, int64_t nowUs) {
+  int64_t delayUs = tokenBucketDelay(bucket, nowUs);
+  return delayUs >= RTP_PACE_MIN_WAIT_US ? delayUs : 0;
+}
+
+void RTSPServer::pacerTimerCallback(void* arg) {
+  RTSPServer* server = static_cast<RTSPServer*>(arg);
+  xSemaphoreGive(server->pacerSemaphore);
+}
+
+/**
+ * @brief Sets the pacing rate for the UDP packets of the current frame.
+ *
+ * The frame's packets to all UDP receivers are spread over pacingPercent of
+ * the frame interval, measured from the frames sent in the last second.
+ *
+ * @param bytes Bytes the frame takes to all UDP receivers.
+ */
+void RTSPServer::startFramePacing(size_t bytes) {
+  this->pacing = false;
+  uint32_t rate = framePacingRate(bytes, this->rtpFps, this->pacingPercent);
+  if (rate == 0) {
+    return;
+  }
+  if (this->pacerTimer == NULL) {
+    this->pacerSemaphore = xSemaphoreCreateBinary();
+    const esp_timer_create_args_t timerConfig = {
+      .callback = pacerTimerCallback,
+      .arg = this,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "rtp_pacer",
+      .skip_unhandled_events = true
+    };
+    if (this->pacerSemaphore == NULL || esp_timer_create(&timerConfig, &this->pacerTimer) != ESP_OK) {
+      RTSP_LOGE(LOG_TAG, "Failed to create pacing timer");
+      this->pacerTimer = NULL;
+      return;
+    }
+  }
+  tokenBucketStart(this->videoPacer, rate, RTP_PACE_BURST, esp_timer_get_time());
+  this->pacing = true;
+}
+
+/**
+ * @brief Waits until the pacer allows the next packet of the frame, then takes its tokens.
+ *
+ * The wait ends on a one-shot esp_timer, so it is not rounded up to the
+ * FreeRTOS tick.
+ */
+void RTSPServer::pacePacket(size_t bytes) {
+  if (!this->pacing) {
+    return;
+  }
+  int64_t delayUs = pacingDelay(this->videoPacer, esp_timer_get_time());
+  if (delayUs > 0) {
+    esp_timer_stop(this->pacerTimer);
+    xSemaphoreTake(this->pacerSemaphore, 0); // Clear a wake up left from an earlier wait
+    if (esp_timer_start_once(this->pacerTimer, delayUs) == ESP_OK) {
+      xSemaphoreTake(this->pacerSemaphore, pdMS_TO_TICKS(delayUs / 1000 + 10));
+    }
+  }
+  tokenBucketTake(this->videoPacer, bytes, esp_timer_get_time());
+}
+
+/**
+ * @brief Checks a session's max bitrate before it is sent a frame.
+ *
+ * Frames are skipped whole while the session is over maxSessionBitrate,
+ * averaged over a second.
+ *
+ * @return false if the frame should be skipped.
+ */
+bool RTSPServer::takeSessionBitrate(RTSP_Session& session, size_t bytes) {
+  int64_t nowUs = esp_timer_get_time();
+  uint32_t rate = this->maxSessionBitrate / 8;
+  if (rate == 0) {
+    return true;
+  }
+  if (session.bitrateBucket.rate != rate) {
+    tokenBucketStart(session.bitrateBucket, rate, rate, nowUs);
+  }
+  if (tokenBucketDelay(session.bitrateBucket, nowUs) > 0) {
+    return false;
+  }
+  tokenBucketTake(session.bitrateBucket, bytes, nowUs);
+  return true;
+}
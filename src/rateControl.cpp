@@ -0,0 +1,127 @@
+#include "ESP32-RTSPServer.h"
+
+#define RATE_TCP_WAIT_LIMIT_US (RTSP_RATE_INTERVAL_MS * 100) // TCP clients behind for 10% of the interval
+#define RATE_LOSS_LIMIT 13 // Fraction lost out of 256, about 5%
+#define RATE_UDP_ERROR_LIMIT 13 // Failed UDP sends out of 256, about 5%
+#define RATE_RTT_LIMIT_US 500000
+#define RATE_RECOVER_INTERVALS 3 // Clean intervals before improving one level
+
+/**
+ * @brief Sets the function called when the recommended capture settings change.
+ *
+ * The callback runs on the task sending video, so it can apply the advice
+ * through sensor_t before the next frame is captured.
+ *
+ * @param callback The function to call, or NULL to only use getRateAdvice().
+ */
+void RTSPServer::setRateCallback(RTSP_RateCallback callback) {
+  this->rateCallback = callback;
+}
+
+/**
+ * @brief Returns the capture settings recommended for the current network conditions.
+ */
+RTSP_RateAdvice RTSPServer::getRateAdvice() const {
+  return this->rateAdvice;
+}
+
+/**
+ * @brief Moves the controller to a level and publishes the matching advice.
+ *
+ * Levels first lower the JPEG quality towards rateMaxQuality, then the frame
+ * rate, then the frame size.
+ */
+void RTSPServer::setRateLevel(uint8_t level) {
+  if (level >= RTSP_RATE_LEVELS) {
+    level = RTSP_RATE_LEVELS - 1;
+  }
+  if (level == this->rateAdvice.level) {
+    return;
+  }
+
+  RTSP_RateAdvice advice;
+  uint8_t qualityLevel = level < 4 ? level : 4;
+  advice.level = level;
+  advice.quality = this->rateMinQuality + (this->rateMaxQuality - this->rateMinQuality) * qualityLevel / 4;
+  advice.fps = level >= 7 ? 10 : (level >= 5 ? 15 : 0);
+  advice.frameSizeSteps = level >= 6 ? -(level - 5) : 0;
+  this->rateAdvice = advice;
+
+  RTSP_LOGI(LOG_TAG, "Rate level %d: quality %d, framesize %d, fps %d", advice.level, advice.quality, advice.frameSizeSteps, advice.fps);
+  if (this->rateCallback) {
+    this->rateCallback(advice);
+  }
+}
+
+/**
+ * @brief Starts the controller at level 0 with the current rateMinQuality.
+ *
+ * Called from init, so rateMinQuality and rateMaxQuality set before it apply
+ * from the first advice.
+ */
+void RTSPServer::startRateControl() {
+  this->rateAdvice.level = 0;
+  this->rateAdvice.quality = this->rateMinQuality;
+  this->rateAdvice.frameSizeSteps = 0;
+  this->rateAdvice.fps = 0;
+  this->rateCleanIntervals = 0;
+  this->rateTcpWaits.store(0, std::memory_order_relaxed);
+  this->rateTcpWaitUs.store(0, std::memory_order_relaxed);
+  this->rateTcpDrops.store(0, std::memory_order_relaxed);
+  this->rateUdpErrors.store(0, std::memory_order_relaxed);
+  this->rateUdpSends.store(0, std::memory_order_relaxed);
+  this->lastRateUpdateTime = millis();
+}
+
+/**
+ * @brief Updates the recommended capture settings from the network feedback.
+ *
+ * Called for each video frame, looks at the signals once per RTSP_RATE_INTERVAL_MS:
+ * time TCP clients spent behind, dropped TCP packets, the share of UDP sends that failed and the loss and round trip time
+ * from RTCP receiver reports. Congestion drops two levels at once, three clean
+ * intervals in a row recover one.
+ */
+void RTSPServer::updateRateControl() {
+  uint32_t now = millis();
+  if (now - this->lastRateUpdateTime < RTSP_RATE_INTERVAL_MS) {
+    return;
+  }
+  this->lastRateUpdateTime = now;
+
+  // Taken and reset in one step, counts added meanwhile by the other tasks go to the next interval
+  uint32_t tcpWaits = this->rateTcpWaits.exchange(0, std::memory_order_relaxed);
+  uint32_t tcpWaitUs = this->rateTcpWaitUs.exchange(0, std::memory_order_relaxed);
+  uint32_t tcpDrops = this->rateTcpDrops.exchange(0, std::memory_order_relaxed);
+  uint32_t udpErrors = this->rateUdpErrors.exchange(0, std::memory_order_relaxed);
+  uint32_t udpSends = this->rateUdpSends.exchange(0, std::memory_order_relaxed);
+  (void)tcpWaits; // Only logged, unused without RTSP_LOGGING_ENABLED
+
+  // An occasional failed UDP send is normal on a busy link, only a share of them is congestion
+  bool udpCongested = (uint64_t)udpErrors * 256 > (uint64_t)udpSends * RATE_UDP_ERROR_LIMIT;
+  bool congested = tcpWaitUs > RATE_TCP_WAIT_LIMIT_US || tcpDrops > 0 || udpCongested;
+  if (congested) {
+    RTSP_LOGD(LOG_TAG, "Rate congestion: %lu TCP packets queued, behind for %lu us, %lu dropped, %lu of %lu UDP sends failed", (unsigned long)tcpWaits, (unsigned long)tcpWaitUs, (unsigned long)tcpDrops, (unsigned long)udpErrors, (unsigned long)udpSends);
+  }
+
+  // Only new receiver reports count, the last one is kept until the next arrives
+  RTSP_PlayingList* playing = acquirePlayingList();
+  for (uint8_t i = 0; i < playing->count; i++) {
+    RTSP_Session& session = *playing->sessions[i];
+    RTCP_ReceiverStats& stats = session.isMulticast ? this->videoMulticastTrack.stats : session.videoTrack.stats;
+    if (stats.fresh.exchange(false, std::memory_order_acquire)) { // Pairs with the release in handleRtcp
+      if (stats.fractionLost > RATE_LOSS_LIMIT || stats.rttUs > RATE_RTT_LIMIT_US) {
+        congested = true;
+      }
+    }
+  }
+  releasePlayingList(playing);
+
+  uint8_t level = this->rateAdvice.level;
+  if (congested) {
+    this->rateCleanIntervals = 0;
+    setRateLevel(level + 2);
+  } else if (level > 0 && ++this->rateCleanIntervals >= RATE_RECOVER_INTERVALS) {
+    this->rateCleanIntervals = 0;
+    setRateLevel(level - 1);
+  }
+}
@@ -0,0 +1,207 @@
+#include "ESP32-RTSPServer.h"
+#include <sys/time.h>
+
+#define NTP_UNIX_OFFSET 2208988800UL // Seconds from 1900 to 1970
+
+/**
+ * @brief Current wall clock as a 64 bit NTP timestamp.
+ */
+static uint64_t ntpNow() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  uint64_t seconds = (uint64_t)tv.tv_sec + NTP_UNIX_OFFSET;
+  uint64_t fraction = ((uint64_t)tv.tv_usec << 32) / 1000000;
+  return (seconds << 32) | fraction;
+}
+
+static void writeUint32(uint8_t* p, uint32_t value) {
+  p[0] = (value >> 24) & 0xFF;
+  p[1] = (value >> 16) & 0xFF;
+  p[2] = (value >> 8) & 0xFF;
+  p[3] = value & 0xFF;
+}
+
+static uint32_t readUint32(const uint8_t* p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * @brief Sends an RTCP sender report with a CNAME for a track when one is due.
+ *
+ * The report maps the wall clock to the track's RTP timestamps, which lets
+ * players sync audio to video. The first report goes out with the first
+ * packets, then every RTCP_SR_INTERVAL_MS.
+ *
+ * @param track The track state of the receiver.
+ * @param clockRate RTP clock rate of the track.
+ * @param clockDrift Difference between the track's timestamps and the media clock.
+ * @param rtcpSocket UDP socket to send from, to the track's RTCP address.
+ * @param useTCP Send interleaved on the track's channel + 1.
+ */
+void RTSPServer::sendSenderReport(RTP_TrackState& track, uint32_t clockRate, int32_t clockDrift, int rtcpSocket, bool useTCP) {
+  int64_t nowUs = esp_timer_get_time();
+  if (track.lastSrUs != 0 && nowUs - track.lastSrUs < (int64_t)RTCP_SR_INTERVAL_MS * 1000) {
+    return;
+  }
+  if (!useTCP && rtcpSocket < 0) {
+    return;
+  }
+  track.lastSrUs = nowUs;
+
+  uint8_t packet[RTCP_PACKET_SIZE];
+  uint8_t* report = packet + RTP_TCP_PREFIX_SIZE;
+  uint64_t ntp = ntpNow();
+  uint32_t timestamp = mediaTimestamp(nowUs, clockRate) + clockDrift + track.timestampOffset;
+
+  // SR, no report blocks as the server does not receive media
+  report[0] = 0x80; // Version 2, no padding, no report blocks
+  report[1] = 200; // SR
+  report[2] = 0;
+  report[3] = 6; // Length in 32 bit words minus one
+  writeUint32(report + 4, track.ssrc);
+  writeUint32(report + 8, (uint32_t)(ntp >> 32));
+  writeUint32(report + 12, (uint32_t)ntp);
+  writeUint32(report + 16, timestamp);
+  writeUint32(report + 20, track.packetCount);
+  writeUint32(report + 24, track.octetCount);
+
+  // SDES with the CNAME, the same for all tracks so players group them
+  uint8_t* sdes = report + 28;
+  IPAddress ip = WiFi.localIP();
+  char cname[32];
+  int cnameLen = snprintf(cname, sizeof(cname), "esp32@%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  int sdesLen = (8 + 2 + cnameLen + 1 + 3) & ~3; // Null terminated item list padded to 32 bits
+  memset(sdes, 0, sdesLen);
+  sdes[0] = 0x81; // Version 2, one chunk
+  sdes[1] = 202; // SDES
+  sdes[2] = 0;
+  sdes[3] = sdesLen / 4 - 1;
+  writeUint32(sdes + 4, track.ssrc);
+  sdes[8] = 1; // CNAME
+  sdes[9] = cnameLen;
+  memcpy(sdes + 10, cname, cnameLen);
+
+  int reportLen = 28 + sdesLen;
+  if (useTCP) {
+    packet[0] = '$';
+    packet[1] = track.channel + 1;
+    packet[2] = (reportLen >> 8) & 0xFF;
+    packet[3] = reportLen & 0xFF;
+    if (track.egress) {
+      sendTcpPacket(packet, RTP_TCP_PREFIX_SIZE + reportLen, *track.egress, RTSP_EGRESS_DATA);
+    }
+  } else if (track.rtcpAddr.sin_port != 0) {
+    sendto(rtcpSocket, report, reportLen, 0, (struct sockaddr*)&track.rtcpAddr, sizeof(track.rtcpAddr));
+  }
+}
+
+/**
+ * @brief Finds the track a receiver report block is about.
+ *
+ * Every receiver gets its own SSRC per track, so the SSRC identifies the session.
+ */
+RTP_TrackState* RTSPServer::findTrackBySSRC(uint32_t ssrc) {
+  for (RTSP_Session& session : this->sessions) {
+    if (!session.inUse) continue;
+    if (session.videoTrack.ssrc == ssrc) return &session.videoTrack;
+    if (session.audioTrack.ssrc == ssrc) return &session.audioTrack;
+    if (session.subtitlesTrack.ssrc == ssrc) return &session.subtitlesTrack;
+  }
+  if (this->videoMulticastTrack.ssrc == ssrc) return &this->videoMulticastTrack;
+  if (this->audioMulticastTrack.ssrc == ssrc) return &this->audioMulticastTrack;
+  if (this->subtitlesMulticastTrack.ssrc == ssrc) return &this->subtitlesMulticastTrack;
+  if (this->fecMulticastTrack.ssrc == ssrc) return &this->fecMulticastTrack;
+  return NULL;
+}
+
+/**
+ * @brief Reads the report blocks of a compound RTCP packet into the track statistics.
+ *
+ * Generic NACKs are passed on for retransmission.
+ *
+ * @param data The RTCP packet.
+ * @param len Length of the packet.
+ */
+void RTSPServer::handleRtcp(const uint8_t* data, size_t len) {
+  uint32_t now = (uint32_t)(ntpNow() >> 16); // Middle 32 bits, as LSR
+  while (len >= 8) {
+    uint8_t version = data[0] >> 6;
+    uint8_t count = data[0] & 0x1F;
+    uint8_t type = data[1];
+    size_t packetLen = (((size_t)data[2] << 8 | data[3]) + 1) * 4;
+    if (version != 2 || packetLen > len) {
+      RTSP_LOGD(LOG_TAG, "Invalid RTCP packet");
+      return;
+    }
+
+    size_t blocks = 0;
+    if (type == 201) { // RR
+      blocks = 8;
+    } else if (type == 200) { // SR
+      blocks = 28;
+    }
+    if (blocks) {
+      for (uint8_t i = 0; i < count && blocks + 24 <= packetLen; i++, blocks += 24) {
+        const uint8_t* block = data + blocks;
+        RTP_TrackState* track = findTrackBySSRC(readUint32(block));
+        if (track == NULL) {
+          continue;
+        }
+        RTCP_ReceiverStats& stats = track->stats;
+        stats.fractionLost = block[4];
+        int32_t lost = (int32_t)((uint32_t)block[5] << 16 | (uint32_t)block[6] << 8 | block[7]);
+        stats.cumulativeLost = (lost & 0x800000) ? lost - 0x1000000 : lost; // 24 bit signed
+        stats.highestSequence = readUint32(block + 8);
+        stats.jitter = readUint32(block + 12);
+        uint32_t lsr = readUint32(block + 16);
+        uint32_t dlsr = readUint32(block + 20);
+        if (lsr != 0) {
+          int32_t rtt = (int32_t)(now - lsr - dlsr); // 1/65536 s
+          if (rtt >= 0) {
+            stats.rttUs = (uint32_t)(((uint64_t)rtt * 1000000) >> 16);
+          }
+        }
+        stats.reports++;
+        stats.fresh.store(true, std::memory_order_release); // Publishes the fields above to the rate controller
+        RTSP_LOGD(LOG_TAG, "RTCP RR ssrc %08lx lost %d/256 total %ld jitter %lu rtt %lu us", (unsigned long)track->ssrc, stats.fractionLost, (long)stats.cumulativeLost, (unsigned long)stats.jitter, (unsigned long)stats.rttUs);
+      }
+    }
+
+    if (type == 205 && count == 1 && packetLen >= 12) { // Generic NACK
+      handleNack(readUint32(data + 8), data + 12, packetLen - 12);
+    }
+
+    data += packetLen;
+    len -= packetLen;
+  }
+}
+
+/**
+ * @brief Handles one interleaved packet received on an RTSP connection.
+ *
+ * RTCP from the receivers is read. RTP sent back by a client, eg. an audio
+ * backchannel, is not supported and dropped.
+ *
+ * @param channel The interleaved channel.
+ * @param data The packet, without the '$' prefix.
+ * @param len Length of the packet.
+ */
+void RTSPServer::handleInterleaved(uint8_t channel, const uint8_t* data, size_t len) {
+  (void)channel; // Only logged, unused without RTSP_LOGGING_ENABLED
+  if (len >= 8 && (data[0] >> 6) == 2 && data[1] >= 200 && data[1] <= 204) {
+    handleRtcp(data, len);
+  } else {
+    RTSP_LOGD(LOG_TAG, "Dropped %u byte interleaved packet on channel %d", (unsigned)len, channel);
+  }
+}
+
+/**
+ * @brief Reads the pending receiver reports from a UDP RTCP socket.
+ */
+void RTSPServer::handleRtcpSocket(int rtcpSocket) {
+  uint8_t buffer[RTCP_PACKET_SIZE * 4];
+  int len;
+  while ((len = recv(rtcpSocket, buffer, sizeof(buffer), 0)) > 0) {
+    handleRtcp(buffer, len);
+  }
+}
@@ -8,35 +8,29 @@ void RTSPServer::rtpVideoTaskWrapper(void* pvParameters) {
 void RTSPServer::rtpVideoTask() {
   while (true) {
     ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-    bool multicastSent = false;
-    for (const auto& sessionPair : this->sessions) {
-      const RTSP_Session& session = sessionPair.second; 
-      if (session.isPlaying) {
-        if (session.isMulticast) {
-          if (!multicastSent) {
-            this->sendRtpFrame(this->rtspStreamBuffer, this->rtspStreamBufferSize, this->vQuality, this->vWidth, this->vHeight, session.sock, this->rtpVideoPort, false, true);
-            multicastSent = true;
-          }
-        } else {
-          this->sendRtpFrame(this->rtspStreamBuffer, this->rtspStreamBufferSize, this->vQuality, this->vWidth, this->vHeight,  session.isHttp ? session.httpSock : session.sock, session.cVideoPort, session.isTCP, false);
-        }
-      }
-    }
+    this->sendVideoFrame(this->rtspStreamBuffer, this->rtspStreamBufferSize, this->vQuality, this->vWidth, this->vHeight);
     this->rtspStreamBufferSize = 0;
     this->rtpFrameSent = true;
   }
   vTaskDelete(NULL);
 }
 
+void RTSPServer::sendRTSPFrame(const uint8_t* data, size_t len) {
+  sendRTSPFrame(data, len, 0, 0, 0, esp_timer_get_time());
+}
+
+void RTSPServer::sendRTSPFrame(const uint8_t* data, size_t len, int64_t captureUs) {
+  sendRTSPFrame(data, len, 0, 0, 0, captureUs);
+}
+
 void RTSPServer::sendRTSPFrame(const uint8_t* data, size_t len, int quality, int width, int height) {
+  sendRTSPFrame(data, len, quality, width, height, esp_timer_get_time());
+}
+
+void RTSPServer::sendRTSPFrame(const uint8_t* data, size_t len, int quality, int width, int height, int64_t captureUs) {
   this->rtpFrameSent = false;
-  static uint32_t lastSendTime = millis(); // Track the last time a frame was sent
   uint32_t currentTime = millis(); // Get the current time in milliseconds
-
-  // Calculate the actual time elapsed since the last frame was sent
-  uint32_t actualElapsedTime = currentTime - lastSendTime;
-  // Increment the timestamp based on the actual elapsed time
-  this->videoTimestamp += (actualElapsedTime * 90000) / 1000;   // Convert milliseconds to 90kHz units
+  uint32_t timestamp = mediaTimestamp(captureUs, 90000);
 
   // Work out the RTP sent FPS to use for subtitles
   this->rtpFrameCount++; 
@@ -47,158 +41,693 @@ void RTSPServer::sendRTSPFrame(const uint8_t* data, size_t len, int quality, int
     this->lastRtpFPSUpdateTime = currentTime; // Update the last FPS update time 
   }
 #ifdef RTSP_VIDEO_NONBLOCK
-  this->vQuality = quality;
-  this->vWidth = width;
-  this->vHeight = height;
   if (!this->rtspStreamBufferSize && this->rtspStreamBuffer != NULL) {
+    this->vQuality = quality;
+    this->vWidth = width;
+    this->vHeight = height;
+    this->videoTimestamp = timestamp;
     memcpy(this->rtspStreamBuffer, data, len);
     this->rtspStreamBufferSize = len;
     xTaskNotifyGive(rtpVideoTaskHandle);
   }
 #else
-  bool multicastSent = false;
-  for (const auto& sessionPair : this->sessions) {
-    const RTSP_Session& session = sessionPair.second; 
-    if (session.isPlaying) {
-      if (session.isMulticast) {
-        if (!multicastSent) { 
-          sendRtpFrame(data, len, quality, width, height, session.sock, this->rtpVideoPort, false, true); 
-          multicastSent = true; 
-        }
-      } else {
-        sendRtpFrame(data, len, quality, width, height,  session.isHttp ? session.httpSock : session.sock, session.cVideoPort, session.isTCP, false);
-      }
-    }
-  }
+  this->videoTimestamp = timestamp;
+  sendVideoFrame(data, len, quality, width, height);
   this->rtpFrameSent = true;
-  lastSendTime = currentTime;
 #endif
 }
 
-void RTSPServer::sendRTSPAudio(int16_t* data, size_t len) {
+void RTSPServer::sendRTSPAudio(int16_t* data, size_t len, bool bigEndian) {
+  sendRTSPAudio(data, len, esp_timer_get_time(), bigEndian);
+}
+
+void RTSPServer::sendRTSPAudio(int16_t* data, size_t len, int64_t captureUs, bool bigEndian) {
+  if (this->audioRing.buffer != NULL) {
+    // Queue native samples, rtpAudioTask sends them in ptime sized packets
+    if (bigEndian) {
+      swapSamples(data, len / 2);
+    }
+    size_t written = writeAudioRing(reinterpret_cast<const uint8_t*>(data), len, captureUs);
+    if (written < len) {
+      RTSP_LOGD(LOG_TAG, "Audio ring full, dropped %u bytes", len - written);
+    }
+    xTaskNotifyGive(this->rtpAudioTaskHandle);
+    return;
+  }
   this->rtpAudioSent = false;
+  sendAudioBlock(data, len, bigEndian, captureUs);
+  this->rtpAudioSent = true;
+}
+
+/**
+ * @brief Encodes one audio block and sends it to all playing sessions.
+ *
+ * Audio timestamps count samples so the sample clock stays exact, and are
+ * re-anchored to the media clock at each talkspurt or when they drift by
+ * more than 40 ms, keeping audio in sync with video.
+ *
+ * @param captureUs Capture time of the first sample in the media clock.
+ */
+void RTSPServer::sendAudioBlock(int16_t* data, size_t len, bool bigEndian, int64_t captureUs) {
+  // A gap longer than two blocks starts a new talkspurt
+  int64_t blockUs = this->sampleRate ? (int64_t)(len / 2) * 1000000 / this->sampleRate : 0;
+  if (captureUs - this->lastAudioCaptureUs > 2 * blockUs + 10000) {
+    this->audioMarker = true;
+  }
+  this->lastAudioCaptureUs = captureUs;
+
+  uint32_t timestamp = mediaTimestamp(captureUs, this->sampleRate);
+  int32_t drift = (int32_t)(timestamp - this->audioTimestamp);
+  if (this->audioMarker || drift > (int32_t)this->sampleRate / 25 || drift < -(int32_t)this->sampleRate / 25) {
+    this->audioTimestamp = timestamp;
+  }
+  this->audioClockDrift = (int32_t)(this->audioTimestamp - timestamp);
+
+  prepareAudio(data, len, bigEndian);
+  RTSP_PlayingList* playing = acquirePlayingList();
   bool multicastSent = false;
-  for (const auto& sessionPair : this->sessions) {
-    const RTSP_Session& session = sessionPair.second; 
-    if (session.isPlaying) {
-      if (session.isMulticast) {
-        if (!multicastSent) {
-          this->sendRtpAudio(data, len, session.sock, this->rtpAudioPort, false, true);
-          multicastSent = true;
-        }
-      } else {
-        this->sendRtpAudio(data, len,  session.isHttp ? session.httpSock : session.sock, session.cAudioPort, session.isTCP, false);
+  for (uint8_t i = 0; i < playing->count; i++) {
+    RTSP_Session& session = *playing->sessions[i];
+    if (session.isMulticast) {
+      if (!multicastSent) {
+        this->sendRtpAudio(getAudioPackets(udpMaxPayload()), this->audioMulticastTrack, false, true);
+        multicastSent = true;
       }
+    } else {
+      this->sendRtpAudio(getAudioPackets(session.audioMaxPayload), session.audioTrack, session.isTCP, false);
     }
   }
-  this->rtpAudioSent = true;
+  releasePlayingList(playing);
+  this->audioTimestamp += this->audioSamples;
+  this->audioMarker = false;
+}
+
+/**
+ * @brief Bytes of raw samples in one audio packet of audioPtime.
+ */
+size_t RTSPServer::audioFrameLen() const {
+  size_t samples = (size_t)this->sampleRate * this->audioPtime / 1000;
+  return (samples & ~1) * 2; // Even sample count so DVI4 packs whole bytes
+}
+
+/**
+ * @brief Allocates the audio ring and starts the task packetizing it.
+ *
+ * @return true if audio is now sent in audioPtime packets from the ring.
+ */
+bool RTSPServer::startAudioRing() {
+  if (this->audioRing.buffer != NULL) {
+    return true;
+  }
+  size_t frameLen = audioFrameLen();
+  size_t ringLen = ((size_t)this->sampleRate * RTSP_AUDIO_RING_MS / 1000) * 2;
+  if (frameLen == 0 || frameLen * 2 > ringLen) {
+    RTSP_LOGW(LOG_TAG, "Audio ptime %u ms not usable, sending audio blocks as passed", this->audioPtime);
+    return false;
+  }
+  uint8_t* buffer = (uint8_t*)(psramFound() ? ps_malloc(ringLen) : malloc(ringLen));
+  this->audioFrameBuffer = (uint8_t*)malloc(frameLen);
+  if (buffer == NULL || this->audioFrameBuffer == NULL) {
+    RTSP_LOGE(LOG_TAG, "Failed to allocate audio ring");
+    free(buffer);
+    free(this->audioFrameBuffer);
+    this->audioFrameBuffer = NULL;
+    return false;
+  }
+  this->audioRing.size = ringLen;
+  this->audioRing.head = 0;
+  this->audioRing.tail = 0;
+  this->audioRing.headTime = 0;
+  if (xTaskCreate(rtpAudioTaskWrapper, "rtpAudioTask", RTP_STACK_SIZE, this, RTP_PRI, &this->rtpAudioTaskHandle) != pdPASS) {
+    RTSP_LOGE(LOG_TAG, "Failed to create RTP audio task");
+    free(buffer);
+    free(this->audioFrameBuffer);
+    this->audioFrameBuffer = NULL;
+    return false;
+  }
+  this->audioRing.buffer = buffer; // Publish last, sendRTSPAudio starts queueing from here
+  return true;
+}
+
+/**
+ * @brief Stops the audio task and frees the ring.
+ *
+ * The task is asked to exit and waited for rather than deleted, it may be
+ * using the playing list or holding sendTcpMutex.
+ */
+void RTSPServer::stopAudioRing() {
+  uint8_t* buffer = this->audioRing.buffer;
+  this->audioRing.buffer = NULL;
+  if (this->rtpAudioTaskHandle != NULL) {
+    this->audioTaskStop.store(true, std::memory_order_release);
+    xTaskNotifyGive(this->rtpAudioTaskHandle);
+    while (this->audioTaskStop.load(std::memory_order_acquire)) {
+      vTaskDelay(1);
+    }
+    this->rtpAudioTaskHandle = NULL;
+  }
+  free(buffer);
+  free(this->audioFrameBuffer);
+  this->audioFrameBuffer = NULL;
+}
+
+/**
+ * @brief Copies samples into the audio ring, called by the capture side only.
+ *
+ * @return Number of bytes queued, less than len if the ring is full.
+ */
+size_t RTSPServer::writeAudioRing(const uint8_t* data, size_t len, int64_t captureUs) {
+  RTP_AudioRing& ring = this->audioRing;
+  size_t head = ring.head.load(std::memory_order_relaxed);
+  size_t tail = ring.tail.load(std::memory_order_acquire);
+  size_t space = ring.size - (head - tail);
+  if (len > space) {
+    len = space & ~1;
+  }
+  size_t offset = head % ring.size;
+  size_t first = (len < ring.size - offset) ? len : ring.size - offset;
+  memcpy(ring.buffer + offset, data, first);
+  memcpy(ring.buffer, data + first, len - first);
+  ring.headTime.store(captureUs + (int64_t)(len / 2) * 1000000 / this->sampleRate, std::memory_order_relaxed);
+  ring.head.store(head + len, std::memory_order_release);
+  return len;
+}
+
+/**
+ * @brief Copies samples out of the audio ring, called by rtpAudioTask only.
+ *
+ * @param captureUs Set to the capture time of the first sample read.
+ * @return Number of bytes read, 0 if less than len is queued.
+ */
+size_t RTSPServer::readAudioRing(uint8_t* data, size_t len, int64_t& captureUs) {
+  RTP_AudioRing& ring = this->audioRing;
+  size_t tail = ring.tail.load(std::memory_order_relaxed);
+  size_t head = ring.head.load(std::memory_order_acquire);
+  if (head - tail < len) {
+    return 0;
+  }
+  size_t offset = tail % ring.size;
+  size_t first = (len < ring.size - offset) ? len : ring.size - offset;
+  memcpy(data, ring.buffer + offset, first);
+  memcpy(data + first, ring.buffer, len - first);
+  // headTime may already belong to a newer write, off by at most one write
+  captureUs = ring.headTime.load(std::memory_order_relaxed) - (int64_t)((head - tail) / 2) * 1000000 / this->sampleRate;
+  ring.tail.store(tail + len, std::memory_order_release);
+  return len;
+}
+
+void RTSPServer::rtpAudioTaskWrapper(void* pvParameters) {
+  RTSPServer* server = static_cast<RTSPServer*>(pvParameters);
+  server->rtpAudioTask();
+}
+
+void RTSPServer::rtpAudioTask() {
+  size_t frameLen = audioFrameLen();
+  int64_t captureUs;
+  while (!this->audioTaskStop.load(std::memory_order_acquire)) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    while (!this->audioTaskStop.load(std::memory_order_acquire) && readAudioRing(this->audioFrameBuffer, frameLen, captureUs) == frameLen) {
+      sendAudioBlock(reinterpret_cast<int16_t*>(this->audioFrameBuffer), frameLen, false, captureUs); // The ring holds native samples
+    }
+  }
+  this->audioTaskStop.store(false, std::memory_order_release); // stopAudioRing frees the ring after this
+  vTaskDelete(NULL);
 }
 
 void RTSPServer::sendRTSPSubtitles(char* data, size_t len) {
+  sendRTSPSubtitles(data, len, esp_timer_get_time());
+}
+
+void RTSPServer::sendRTSPSubtitles(char* data, size_t len, int64_t captureUs) {
   this->rtpSubtitlesSent = false;
+  this->subtitlesTimestamp = mediaTimestamp(captureUs, 1000);
+  packetizeSubtitles(data, len);
+  RTSP_PlayingList* playing = acquirePlayingList();
   bool multicastSent = false;
-  for (const auto& sessionPair : this->sessions) {
-    const RTSP_Session& session = sessionPair.second; 
-    if (session.isPlaying) {
-      if (session.isMulticast) {
-          if (!multicastSent) {
-            this->sendRtpSubtitles(data, len, session.sock, this->rtpSubtitlesPort, false, true);
-            multicastSent = true;
-        }
-      } else {
-        this->sendRtpSubtitles(data, len,  session.isHttp ? session.httpSock : session.sock, session.cSrtPort, session.isTCP, false);
+  for (uint8_t i = 0; i < playing->count; i++) {
+    RTSP_Session& session = *playing->sessions[i];
+    if (session.isMulticast) {
+      if (!multicastSent) {
+        this->sendRtpSubtitles(this->subtitlesMulticastTrack, false, true);
+        multicastSent = true;
       }
+    } else {
+      this->sendRtpSubtitles(session.subtitlesTrack, session.isTCP, false);
     }
   }
+  releasePlayingList(playing);
   this->rtpSubtitlesSent = true;
 }
 
-void RTSPServer::sendRtpFrame(const uint8_t* data, size_t len, uint8_t quality, uint16_t width, uint16_t height, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast) {
-  const int RtpHeaderSize = 20;
-  const int MAX_FRAGMENT_SIZE = 1438;
-  uint32_t jpegLen = len;
+/**
+ * @brief Prepares a frame for packetization, the payloads will reference the frame data.
+ *
+ * Baseline JPEGs are sent as RFC 2435 payload: only the scan data is sent and
+ * the quantization tables go in-band. Other frames are sent whole as type 0
+ * using the caller supplied quality and size.
+ *
+ * @return true if the frame can be sent, false otherwise.
+ */
+bool RTSPServer::prepareFrame(const uint8_t* data, size_t len, uint8_t quality, uint16_t width, uint16_t height) {
+  static const uint8_t emptyQTableHeader[RTP_JPEG_QTABLE_HEADER_SIZE] = { 0, 0, 0, 0 };
+  RTP_VideoFrame& frame = this->videoFrame;
+
+  // Invalidate the packets of the previous frame
+  this->videoFrameNumber++;
+
+  JPEG_Info jpeg;
+  if (parseJpeg(data, len, jpeg)) {
+    frame.data = jpeg.scanData;
+    frame.len = jpeg.scanLen;
+    frame.type = jpeg.type;
+    frame.restartInterval = jpeg.restartInterval;
+    frame.width = jpeg.width;
+    frame.height = jpeg.height;
+    if (updateQTables(jpeg)) {
+      frame.qTables = this->qTableHeader;
+      frame.qTablesLen = sizeof(this->qTableHeader);
+    } else {
+      frame.qTables = emptyQTableHeader;
+      frame.qTablesLen = sizeof(emptyQTableHeader);
+    }
+    frame.quality = this->jpegQ;
+  } else if (quality == 0 || width == 0 || height == 0) {
+    RTSP_LOGE(LOG_TAG, "Frame is not a baseline JPEG and no quality or size was given, dropping frame");
+    return false;
+  } else {
+    frame.data = data;
+    frame.len = len;
+    frame.type = 0;
+    frame.restartInterval = 0;
+    frame.width = width;
+    frame.height = height;
+    frame.qTables = NULL;
+    frame.qTablesLen = 0;
+    frame.quality = quality;
+  }
+  return true;
+}
+
+/**
+ * @brief Packetizes the current frame for one max payload size.
+ *
+ * Frames with restart markers are split on restart interval boundaries where
+ * possible.
+ */
+void RTSPServer::packetizeFrame(std::vector<RTP_Packet>& packets, uint16_t maxPayload) {
+  const RTP_VideoFrame& frame = this->videoFrame;
+  const uint8_t* data = frame.data;
+  uint8_t type = frame.type;
+  uint8_t quality = frame.quality;
+  uint16_t width = frame.width;
+  uint16_t height = frame.height;
+  uint16_t restartInterval = frame.restartInterval;
+  const uint8_t* qTables = frame.qTables;
+  uint16_t qTablesLen = frame.qTablesLen;
+
+  packets.clear();
+
+  uint32_t jpegLen = frame.len;
+  uint8_t restartHeaderLen = restartInterval ? RTP_JPEG_RESTART_HEADER_SIZE : 0;
+  if (restartInterval) {
+    type += 64; // Types 64-127 carry a restart marker header
+  }
 
   size_t fragmentOffset = 0;
+  size_t intervalStart = 0; // Start of the restart interval at fragmentOffset
+  size_t intervalEnd = restartInterval ? findNextRestart(data, jpegLen, 0) : jpegLen;
+  uint32_t restartCount = 0; // Index of the restart interval at fragmentOffset
   while (fragmentOffset < jpegLen) {
-    int fragmentLen = MAX_FRAGMENT_SIZE;
+    // Quantization table header goes in the first packet only
+    uint16_t extLen = (fragmentOffset == 0) ? qTablesLen : 0;
+    size_t maxLen = maxPayload - RTP_JPEG_HEADER_SIZE - extLen - restartHeaderLen;
+    size_t fragmentLen = maxLen;
     if (fragmentLen + fragmentOffset > jpegLen) {
       fragmentLen = jpegLen - fragmentOffset;
     }
 
+    // Align packets to restart intervals so a lost packet only loses its own intervals
+    bool firstPart = true;
+    bool lastPart = true;
+    uint32_t packetRestartCount = restartCount;
+    if (restartInterval) {
+      firstPart = fragmentOffset == intervalStart;
+      if (intervalEnd - fragmentOffset <= maxLen) {
+        // Ends on an interval boundary, add as many whole intervals as fit
+        size_t end = intervalEnd;
+        restartCount++;
+        while (firstPart && end < jpegLen) {
+          size_t next = findNextRestart(data, jpegLen, end);
+          if (next - fragmentOffset > maxLen) {
+            intervalEnd = next;
+            break;
+          }
+          end = next;
+          restartCount++;
+        }
+        if (!firstPart && end < jpegLen) {
+          intervalEnd = findNextRestart(data, jpegLen, end);
+        }
+        intervalStart = end;
+        fragmentLen = end - fragmentOffset;
+      } else {
+        // Interval larger than a packet, it is split with the F and L bits
+        fragmentLen = maxLen;
+        lastPart = false;
+      }
+    }
+
     bool isLastFragment = (fragmentOffset + fragmentLen) == jpegLen;
-    int RtpPacketSize = fragmentLen + RtpHeaderSize;
+    int RtpPacketSize = fragmentLen + extLen + RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE + restartHeaderLen;
 
-    uint8_t packet[2048];
-    memset(packet, 0x00, sizeof(packet));
+    RTP_Packet rtpPacket;
+    uint8_t* packet = rtpPacket.header;
 
     // If TCP, we need these first 4 bytes
     packet[0] = '$'; // Magic number 
-    packet[1] = this->videoCh; // Channel number for RTP (0 for video)
+    packet[1] = 0; // Channel number, set per session
     packet[2] = (RtpPacketSize >> 8) & 0xFF; // Packet length high byte 
     packet[3] = RtpPacketSize & 0xFF; // Packet length low byte
     
     // RTP header
     packet[4] = 0x80;
     packet[5] = 0x1A | (isLastFragment ? 0x80 : 0x00);
-    packet[6] = (this->videoSequenceNumber >> 8) & 0xFF;
-    packet[7] = this->videoSequenceNumber & 0xFF;
+    packet[6] = 0; // Sequence Number, set per session
+    packet[7] = 0;
     packet[8] = (this->videoTimestamp >> 24) & 0xFF;
     packet[9] = (this->videoTimestamp >> 16) & 0xFF;
     packet[10] = (this->videoTimestamp >> 8) & 0xFF;
     packet[11] = this->videoTimestamp & 0xFF;
-    packet[12] = (this->videoSSRC >> 24) & 0xFF;
-    packet[13] = (this->videoSSRC >> 16) & 0xFF;
-    packet[14] = (this->videoSSRC >> 8) & 0xFF;
-    packet[15] = this->videoSSRC & 0xFF;
+    packet[12] = 0; // SSRC, set per session
+    packet[13] = 0;
+    packet[14] = 0;
+    packet[15] = 0;
 
     // JPEG RTP header
-    packet[16] = 0x00;
+    packet[16] = 0x00; // Type specific
     packet[17] = (fragmentOffset >> 16) & 0xFF;
     packet[18] = (fragmentOffset >> 8) & 0xFF;
     packet[19] = fragmentOffset & 0xFF;
-    packet[20] = 0x00;
+    packet[20] = type;
     packet[21] = quality;
     packet[22] = width / 8;
     packet[23] = height / 8;
 
-    int packetOffset = 24;
+    if (restartInterval) {
+      // Restart marker header
+      // 14 bit field, wraps before 0x3FFF which RFC 2435 reserves for restart markers not aligned to packets
+      uint16_t count = packetRestartCount % 0x3FFF;
+      packet[24] = (restartInterval >> 8) & 0xFF;
+      packet[25] = restartInterval & 0xFF;
+      packet[26] = (firstPart ? 0x80 : 0x00) | (lastPart ? 0x40 : 0x00) | ((count >> 8) & 0x3F);
+      packet[27] = count & 0xFF;
+    }
 
-    // Copy JPEG data to the packet
-    memcpy(packet + packetOffset, data + fragmentOffset, fragmentLen);
-    packetOffset += fragmentLen;
+    rtpPacket.headerLen = RTP_TCP_PREFIX_SIZE + RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE + restartHeaderLen;
+    rtpPacket.headerExt = extLen ? qTables : NULL;
+    rtpPacket.headerExtLen = extLen;
+    rtpPacket.payload = data + fragmentOffset;
+    rtpPacket.payloadLen = fragmentLen;
+    packets.push_back(rtpPacket);
 
-    // Send packet using TCP or UDP
-    if (useTCP) {
-      sendTcpPacket(packet, packetOffset, sock);
-    } else {
-      struct sockaddr_in client_addr;
-      memset(&client_addr, 0, sizeof(client_addr));
-      client_addr.sin_family = AF_INET;
-      // Determine IP address based on whether it's multicast or unicast
-      if (isMulticast) {
-        inet_aton(this->rtpIp.toString().c_str(), &client_addr.sin_addr);
-      } else {
-        socklen_t addrLen = sizeof(client_addr);
-        if (getpeername(sock, (struct sockaddr*)&client_addr, &addrLen) == -1) {
-          RTSP_LOGE(LOG_TAG, "Failed to get peer IP address");
-          return;
-        }
+    fragmentOffset += fragmentLen;
+  }
+}
+
+/**
+ * @brief Packetizes a frame and sends the same packets to every playing session.
+ */
+void RTSPServer::sendVideoFrame(const uint8_t* data, size_t len, uint8_t quality, uint16_t width, uint16_t height) {
+  updateRateControl();
+  if (!prepareFrame(data, len, quality, width, height)) {
+    return;
+  }
+
+  RTSP_PlayingList* playing = acquirePlayingList();
+  uint8_t udpReceivers = 0;
+  for (uint8_t i = 0; i < playing->count; i++) {
+    if (!playing->sessions[i]->isTCP) {
+      udpReceivers++; // The multicast session is listed once
+    }
+  }
+  startFramePacing(udpReceivers * this->videoFrame.len);
+
+  bool multicastSent = false;
+  for (uint8_t i = 0; i < playing->count; i++) {
+    RTSP_Session& session = *playing->sessions[i];
+    if (session.isMulticast) {
+      if (!multicastSent) { 
+        uint16_t maxPayload = this->fecGroupSize ? udpMaxPayload() - RTP_FEC_HEADER_SIZE : udpMaxPayload(); // Room for the FEC header
+        sendRtpFrame(getVideoPackets(maxPayload), this->videoMulticastTrack, false, true);
+        multicastSent = true; 
       }
-      client_addr.sin_port = htons(sendRtpPort);
+    } else if (selectFrame(session) && takeSessionBitrate(session, this->videoFrame.len)) {
+      sendRtpFrame(getVideoPackets(session.maxPayload), session.videoTrack, session.isTCP, false);
+    }
+  }
+  releasePlayingList(playing);
+}
 
-      int rtpSocket = isMulticast ? this->videoMulticastSocket : this->videoUnicastSocket;
+/**
+ * @brief Decides if a unicast session gets the current frame, for clients limited to a lower frame rate.
+ *
+ * The rate is the lower of the client's ?fps= and maxSessionFps. Frames are
+ * picked on a fixed schedule of video timestamps, a frame up to half an
+ * interval early counts as on time so capture jitter does not lower the rate.
+ */
+bool RTSPServer::selectFrame(RTSP_Session& session) {
+  uint8_t fps = session.maxFps;
+  if (this->maxSessionFps && (fps == 0 || this->maxSessionFps < fps)) {
+    fps = this->maxSessionFps;
+  }
+  if (fps == 0) {
+    return true;
+  }
+  int32_t interval = 90000 / fps;
+  int32_t early = (int32_t)(session.nextFrameTimestamp - this->videoTimestamp);
+  if (early > interval / 2 && early <= 2 * interval) {
+    return false;
+  }
+  if (early < -interval || early > 2 * interval) {
+    session.nextFrameTimestamp = this->videoTimestamp + interval; // Restart the schedule after a gap
+  } else {
+    session.nextFrameTimestamp += interval;
+  }
+  return true;
+}
 
-      sendto(rtpSocket, packet + 4, packetOffset - 4, 0, (struct sockaddr*)&client_addr, sizeof(client_addr));
+/**
+ * @brief Returns the current frame packetized for a max payload size, packetizing it if needed.
+ */
+const std::vector<RTP_Packet>& RTSPServer::getVideoPackets(uint16_t maxPayload) {
+  RTP_PacketList& list = selectPacketList(this->videoPacketLists, maxPayload, this->videoFrameNumber);
+  if (list.number != this->videoFrameNumber || list.maxPayload != maxPayload) {
+    packetizeFrame(list.packets, maxPayload);
+    list.number = this->videoFrameNumber;
+    list.maxPayload = maxPayload;
+  }
+  return list.packets;
+}
+
+/**
+ * @brief Finds the packet list for a payload size, or the list to reuse for it.
+ */
+RTP_PacketList& RTSPServer::selectPacketList(RTP_PacketList* lists, uint16_t maxPayload, uint32_t number) {
+  RTP_PacketList* stale = &lists[RTP_PACKET_LISTS - 1];
+  for (int i = 0; i < RTP_PACKET_LISTS; i++) {
+    if (lists[i].maxPayload == maxPayload) {
+      return lists[i];
+    }
+    if (lists[i].number != number) {
+      stale = &lists[i];
     }
-    fragmentOffset += fragmentLen;
-    this->videoSequenceNumber++;
   }
+  return *stale;
 }
 
-void RTSPServer::sendRtpAudio(const int16_t* data, size_t len, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast) {
+/**
+ * @brief Max RTP payload size, including payload headers, that fits the UDP MTU.
+ */
+uint16_t RTSPServer::udpMaxPayload() const {
+  uint16_t mtu = this->rtpMtu < 576 ? 576 : this->rtpMtu;
+#ifdef RTSP_VIDEO_NACK
+  return mtu - RTP_UDP_OVERHEAD - RTP_HEADER_SIZE - 2; // Room for the RTX original sequence number
+#else
+  return mtu - RTP_UDP_OVERHEAD - RTP_HEADER_SIZE;
+#endif
+}
+
+/**
+ * @brief Sends the packets of a frame to one receiver, or to the multicast group.
+ *
+ * TCP receivers get whole frames only: a receiver whose queue cannot take the
+ * frame skips it, the player would discard a truncated one anyway.
+ */
+void RTSPServer::sendRtpFrame(const std::vector<RTP_Packet>& packets, RTP_TrackState& track, bool useTCP, bool isMulticast) {
+  if (useTCP && track.egress != NULL) {
+    size_t frameLen = 0;
+    for (const RTP_Packet& packet : packets) {
+      frameLen += packet.headerLen + packet.headerExtLen + packet.payloadLen;
+    }
+    if (!egressQueueFits(*track.egress, frameLen, packets.size())) {
+      track.egress->skippedFrames++;
+      this->rtpFramesSkipped++;
+      this->rateTcpDrops.fetch_add(1, std::memory_order_relaxed); // Skipping is congestion for the rate controller too
+      return;
+    }
+  }
+
+  int rtpSocket = isMulticast ? this->videoMulticastSocket : this->videoUnicastSocket;
+  bool useFec = isMulticast && this->fecGroupSize;
+  uint8_t fecGroup = this->fecGroupSize < RTP_FEC_MAX_GROUP ? this->fecGroupSize : RTP_FEC_MAX_GROUP;
+  for (const RTP_Packet& packet : packets) {
+    uint16_t sequenceNumber = track.sequenceNumber;
+    if (!useTCP) {
+      pacePacket(packet.headerLen - RTP_TCP_PREFIX_SIZE + packet.headerExtLen + packet.payloadLen);
+    }
+    if (!sendRtpPacket(packet, track, rtpSocket, useTCP)) {
+      RTSP_LOGD(LOG_TAG, "TCP client was evicted, dropping the rest of the frame");
+      break;
+    }
+    if (useFec && track.sequenceNumber != sequenceNumber) { // Only packets that took a number are protected
+      addFecPacket(packet, sequenceNumber, track.timestampOffset);
+      if (this->videoFec.count >= fecGroup) {
+        sendFecPacket(rtpSocket);
+      }
+    }
+  }
+  if (useFec) {
+    sendFecPacket(rtpSocket); // Groups end with the frame
+    sendSenderReport(this->fecMulticastTrack, 90000, 0, rtpSocket, false);
+  }
+  sendSenderReport(track, 90000, 0, isMulticast ? rtpSocket : this->videoRtcpSocket, useTCP);
+}
+
+/**
+ * @brief Sends a packet as header and payload segments so the payload is not copied.
+ *
+ * The shared header is copied and patched with the receiver's channel, sequence
+ * number, timestamp offset and SSRC.
+ *
+ * @return false if a TCP client's queue had no room for the packet.
+ */
+bool RTSPServer::sendRtpPacket(const RTP_Packet& packet, RTP_TrackState& track, int rtpSocket, bool useTCP) {
+  uint8_t header[MAX_RTP_PACKET_HEADER];
+  memcpy(header, packet.header, packet.headerLen);
+
+  uint32_t timestamp = ((uint32_t)header[8] << 24 | (uint32_t)header[9] << 16 | (uint32_t)header[10] << 8 | header[11]) + track.timestampOffset;
+  header[1] = track.channel;
+  header[6] = (track.sequenceNumber >> 8) & 0xFF;
+  header[7] = track.sequenceNumber & 0xFF;
+  header[8] = (timestamp >> 24) & 0xFF;
+  header[9] = (timestamp >> 16) & 0xFF;
+  header[10] = (timestamp >> 8) & 0xFF;
+  header[11] = timestamp & 0xFF;
+  header[12] = (track.ssrc >> 24) & 0xFF;
+  header[13] = (track.ssrc >> 16) & 0xFF;
+  header[14] = (track.ssrc >> 8) & 0xFF;
+  header[15] = track.ssrc & 0xFF;
+
+  struct iovec iov[3];
+  iov[1].iov_base = const_cast<uint8_t*>(packet.headerExt);
+  iov[1].iov_len = packet.headerExtLen;
+  iov[2].iov_base = const_cast<uint8_t*>(packet.payload);
+  iov[2].iov_len = packet.payloadLen;
+
+  // Send packet using TCP or UDP
+  if (useTCP) {
+    iov[0].iov_base = header;
+    iov[0].iov_len = packet.headerLen;
+    if (track.egress == NULL || !sendTcpPacket(iov, 3, *track.egress, track.egressClass)) {
+      return false;
+    }
+  } else {
+    if (track.rtpAddr.sin_port == 0) {
+      return true;
+    }
+
+    // Skip the interleaved prefix for UDP
+    iov[0].iov_base = header + RTP_TCP_PREFIX_SIZE;
+    iov[0].iov_len = packet.headerLen - RTP_TCP_PREFIX_SIZE;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &track.rtpAddr;
+    msg.msg_namelen = sizeof(track.rtpAddr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    if (track.history != NULL) {
+      storeHistory(track, track.sequenceNumber, iov, 3);
+    }
+    this->rateUdpSends.fetch_add(1, std::memory_order_relaxed);
+    if (sendmsg(rtpSocket, &msg, 0) < 0) {
+      this->rateUdpErrors.fetch_add(1, std::memory_order_relaxed); // Usually out of buffers, the link is behind
+      track.sequenceNumber++; // Lost like on the network, the receiver sees the gap and can NACK it from the history
+      return true;
+    }
+  }
+  // A packet dropped from a TCP queue keeps its number for the next packet
+  track.sequenceNumber++;
+  track.packetCount++;
+  track.octetCount += packet.headerLen - RTP_TCP_PREFIX_SIZE - RTP_HEADER_SIZE + packet.headerExtLen + packet.payloadLen;
+  return true;
+}
+
+/**
+ * @brief Prepares an audio block for packetization.
+ *
+ * The samples are encoded with the selected codec (or converted to network byte
+ * order for L16) in place so the payloads can reference the caller's buffer directly.
+ */
+void RTSPServer::prepareAudio(int16_t* data, size_t len, bool bigEndian) {
+  size_t samples = len / 2;
+  if (bigEndian && this->audioCodec != AUDIO_L16) {
+    swapSamples(data, samples);  // The encoders take native samples
+  }
+  switch (this->audioCodec) {
+    case AUDIO_PCMU:
+    case AUDIO_PCMA:
+      encodeG711(data, samples, this->audioCodec == AUDIO_PCMA);
+      this->audioLen = samples;
+      break;
+    case AUDIO_DVI4:
+      // DVI4 blocks carry the encoder state, so they are cut once for the smallest payload
+      this->audioLen = encodeDvi4(data, samples, udpMaxPayload() - RTP_DVI4_HEADER_SIZE, this->adpcmHeaders);
+      samples = this->audioLen * 2;
+      break;
+    case AUDIO_L16:
+    default:
+      if (!bigEndian) {
+        swapSamples(data, samples);
+      }
+      this->audioLen = samples * 2;
+      break;
+  }
+
+  this->audioData = reinterpret_cast<const uint8_t*>(data);
+  this->audioSamples = samples;
+  this->audioBlockNumber++;
+}
+
+/**
+ * @brief Packetizes the current audio block for one max payload size.
+ */
+void RTSPServer::packetizeAudio(std::vector<RTP_Packet>& packets, uint16_t maxPayload) {
   const int RtpHeaderSize = 12; // RTP header size
-  const int MAX_FRAGMENT_SIZE = 1446; // Adjust based on your requirements
-  uint32_t audioLen = len;
+  const bool isDvi4 = this->audioCodec == AUDIO_DVI4;
+  int MAX_FRAGMENT_SIZE;
+  if (isDvi4) {
+    MAX_FRAGMENT_SIZE = udpMaxPayload() - RTP_DVI4_HEADER_SIZE; // Fixed blocks, see prepareAudio
+  } else if (this->audioCodec == AUDIO_L16) {
+    MAX_FRAGMENT_SIZE = maxPayload & ~1; // Whole samples only
+  } else {
+    MAX_FRAGMENT_SIZE = maxPayload;
+  }
+  const uint8_t payloadType = audioPayloadType();
+  bool marker = this->audioMarker;
+  uint32_t audioLen = this->audioLen;
+
+  packets.clear();
 
   size_t fragmentOffset = 0;
   while (fragmentOffset < audioLen) {
@@ -206,124 +735,109 @@ void RTSPServer::sendRtpAudio(const int16_t* data, size_t len, int sock, uint16_
     if (fragmentLen + fragmentOffset > audioLen) {
       fragmentLen = audioLen - fragmentOffset;
     }
+    // Convert offset to number of samples
+    uint32_t timestamp = this->audioTimestamp;
+    if (isDvi4) {
+      timestamp += fragmentOffset * 2;
+    } else if (this->audioCodec == AUDIO_L16) {
+      timestamp += fragmentOffset / 2;
+    } else {
+      timestamp += fragmentOffset;
+    }
+    int headerExtLen = isDvi4 ? RTP_DVI4_HEADER_SIZE : 0;
 
-    int RtpPacketSize = fragmentLen + RtpHeaderSize;
-    uint8_t packet[2048];
-    memset(packet, 0x00, sizeof(packet));
+    int RtpPacketSize = fragmentLen + headerExtLen + RtpHeaderSize;
+    RTP_Packet rtpPacket;
+    uint8_t* packet = rtpPacket.header;
 
     // If TCP, we need these first 4 bytes
     packet[0] = '$'; // Magic number 
-    packet[1] = this->audioCh; // Channel number for RTP (1 for audio)
+    packet[1] = 0; // Channel number, set per session
     packet[2] = (RtpPacketSize >> 8) & 0xFF; // Packet length high byte 
     packet[3] = RtpPacketSize & 0xFF; // Packet length low byte
 
     // RTP header
     packet[4] = 0x80; // Version: 2, Padding: 0, Extension: 0, CSRC Count: 0
-    packet[5] = 0x61 | 0x80;  // Dynamic payload type (97) and marker bit
-    packet[6] = (this->audioSequenceNumber >> 8) & 0xFF; // Sequence Number (high byte)
-    packet[7] = this->audioSequenceNumber & 0xFF; // Sequence Number (low byte)
-    packet[8] = (this->audioTimestamp >> 24) & 0xFF; // Timestamp (high byte)
-    packet[9] = (this->audioTimestamp >> 16) & 0xFF; // Timestamp (next byte)
-    packet[10] = (this->audioTimestamp >> 8) & 0xFF; // Timestamp (next byte)
-    packet[11] = this->audioTimestamp & 0xFF; // Timestamp (low byte)
-    packet[12] = (this->audioSSRC >> 24) & 0xFF; // SSRC (high byte)
-    packet[13] = (this->audioSSRC >> 16) & 0xFF; // SSRC (next byte)
-    packet[14] = (this->audioSSRC >> 8) & 0xFF; // SSRC (next byte)
-    packet[15] = this->audioSSRC & 0xFF; // SSRC (low byte)
-
-    int packetOffset = RtpHeaderSize + 4;
-
-    // Convert audio data from little-endian to big-endian and copy to the packet
-    for (size_t i = 0; i < fragmentLen / 2; i++) {
-      packet[packetOffset++] = (data[fragmentOffset / 2 + i] >> 8) & 0xFF; // High byte
-      packet[packetOffset++] = data[fragmentOffset / 2 + i] & 0xFF; // Low byte
-    }
+    packet[5] = payloadType | (marker ? 0x80 : 0);  // Payload type, marker bit on the first packet of a talkspurt
+    marker = false;
+    packet[6] = 0; // Sequence Number, set per session
+    packet[7] = 0;
+    packet[8] = (timestamp >> 24) & 0xFF; // Timestamp (high byte)
+    packet[9] = (timestamp >> 16) & 0xFF; // Timestamp (next byte)
+    packet[10] = (timestamp >> 8) & 0xFF; // Timestamp (next byte)
+    packet[11] = timestamp & 0xFF; // Timestamp (low byte)
+    packet[12] = 0; // SSRC, set per session
+    packet[13] = 0;
+    packet[14] = 0;
+    packet[15] = 0;
+
+    rtpPacket.headerLen = RTP_TCP_PREFIX_SIZE + RtpHeaderSize;
+    rtpPacket.headerExt = isDvi4 ? &this->adpcmHeaders[fragmentOffset / MAX_FRAGMENT_SIZE * RTP_DVI4_HEADER_SIZE] : NULL;
+    rtpPacket.headerExtLen = headerExtLen;
+    rtpPacket.payload = this->audioData + fragmentOffset;
+    rtpPacket.payloadLen = fragmentLen;
+    packets.push_back(rtpPacket);
 
-    // Send packet using TCP or UDP
-    if (useTCP) {
-      sendTcpPacket(packet, packetOffset, sock);
-    } else {
-      struct sockaddr_in client_addr;
-      memset(&client_addr, 0, sizeof(client_addr));
-      client_addr.sin_family = AF_INET;
-      // Determine IP address based on whether it's multicast or unicast
-      if (isMulticast) {
-        inet_aton(this->rtpIp.toString().c_str(), &client_addr.sin_addr);
-      } else {
-        socklen_t addrLen = sizeof(client_addr);
-        if (getpeername(sock, (struct sockaddr*)&client_addr, &addrLen) == -1) {
-          RTSP_LOGE(LOG_TAG, "Failed to get peer IP address");
-          return;
-        }
-      }
-      client_addr.sin_port = htons(sendRtpPort);
+    fragmentOffset += fragmentLen;
+  }
+}
 
-      int rtpSocket = isMulticast ? this->audioMulticastSocket : this->audioUnicastSocket;
+/**
+ * @brief Returns the current audio block packetized for a max payload size, packetizing it if needed.
+ */
+const std::vector<RTP_Packet>& RTSPServer::getAudioPackets(uint16_t maxPayload) {
+  RTP_PacketList& list = selectPacketList(this->audioPacketLists, maxPayload, this->audioBlockNumber);
+  if (list.number != this->audioBlockNumber || list.maxPayload != maxPayload) {
+    packetizeAudio(list.packets, maxPayload);
+    list.number = this->audioBlockNumber;
+    list.maxPayload = maxPayload;
+  }
+  return list.packets;
+}
 
-      sendto(rtpSocket, packet + 4, packetOffset - 4, 0, (struct sockaddr*)&client_addr, sizeof(client_addr));
-    }
-    fragmentOffset += fragmentLen;
-    this->audioSequenceNumber++;
-    this->audioTimestamp += fragmentLen / 2; // Convert fragment length to number of samples
+void RTSPServer::sendRtpAudio(const std::vector<RTP_Packet>& packets, RTP_TrackState& track, bool useTCP, bool isMulticast) {
+  int rtpSocket = isMulticast ? this->audioMulticastSocket : this->audioUnicastSocket;
+  for (const RTP_Packet& packet : packets) {
+    sendRtpPacket(packet, track, rtpSocket, useTCP);
   }
+  sendSenderReport(track, this->sampleRate, this->audioClockDrift, isMulticast ? rtpSocket : this->audioRtcpSocket, useTCP);
 }
 
-void RTSPServer::sendRtpSubtitles(const char* data, size_t len, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast) {
+void RTSPServer::packetizeSubtitles(const char* data, size_t len) {
   const int RtpHeaderSize = 12; // RTP header size
   int RtpPacketSize = len + RtpHeaderSize;
 
-  uint8_t packet[512];
-  memset(packet, 0x00, sizeof(packet));
+  uint8_t* packet = this->subtitlesPacket.header;
 
   // If TCP, we need these first 4 bytes
   packet[0] = '$'; // Magic number 
-  packet[1] = this->subtitlesCh; // Channel number for RTP (2 for subtitles)
+  packet[1] = 0; // Channel number, set per session
   packet[2] = (RtpPacketSize >> 8) & 0xFF; // Packet length high byte 
   packet[3] = RtpPacketSize & 0xFF; // Packet length low byte
   
   // RTP header
   packet[4] = 0x80; // Version: 2, Padding: 0, Extension: 0, CSRC Count: 0
   packet[5] = 0x80 | 0x62; // Marker bit set and payload type 98
-  packet[6] = (this->subtitlesSequenceNumber >> 8) & 0xFF; // Sequence Number (high byte)
-  packet[7] = this->subtitlesSequenceNumber & 0xFF; // Sequence Number (low byte)
+  packet[6] = 0; // Sequence Number, set per session
+  packet[7] = 0;
   packet[8] = (this->subtitlesTimestamp >> 24) & 0xFF; // Timestamp (high byte)
   packet[9] = (this->subtitlesTimestamp >> 16) & 0xFF; // Timestamp (next byte)
   packet[10] = (this->subtitlesTimestamp >> 8) & 0xFF; // Timestamp (next byte)
   packet[11] = this->subtitlesTimestamp & 0xFF; // Timestamp (low byte)
-  packet[12] = (this->subtitlesSSRC >> 24) & 0xFF; // SSRC (high byte)
-  packet[13] = (this->subtitlesSSRC >> 16) & 0xFF; // SSRC (next byte)
-  packet[14] = (this->subtitlesSSRC >> 8) & 0xFF; // SSRC (next byte)
-  packet[15] = this->subtitlesSSRC & 0xFF; // SSRC (low byte)
-
-  int packetOffset = RtpHeaderSize + 4;
-
-  // Copy SRT data to the packet
-  memcpy(packet + packetOffset, data, len);
-  packetOffset += len;
-
-  // Send packet using TCP or UDP
-  if (useTCP) {
-    sendTcpPacket(packet, packetOffset, sock);
-  } else {
-    struct sockaddr_in client_addr;
-    memset(&client_addr, 0, sizeof(client_addr));
-    client_addr.sin_family = AF_INET;
-    // Determine IP address based on whether it's multicast or unicast
-    if (isMulticast) {
-      inet_aton(this->rtpIp.toString().c_str(), &client_addr.sin_addr);
-    } else {
-      socklen_t addrLen = sizeof(client_addr);
-      if (getpeername(sock, (struct sockaddr*)&client_addr, &addrLen) == -1) {
-        RTSP_LOGE(LOG_TAG, "Failed to get peer IP address");
-        return;
-      }
-    }
-    client_addr.sin_port = htons(sendRtpPort);  
-
-    int rtpSocket = isMulticast ? this->subtitlesMulticastSocket : this->subtitlesUnicastSocket;
+  packet[12] = 0; // SSRC, set per session
+  packet[13] = 0;
+  packet[14] = 0;
+  packet[15] = 0;
+
+  this->subtitlesPacket.headerLen = RTP_TCP_PREFIX_SIZE + RtpHeaderSize;
+  this->subtitlesPacket.headerExt = NULL;
+  this->subtitlesPacket.headerExtLen = 0;
+  this->subtitlesPacket.payload = reinterpret_cast<const uint8_t*>(data);
+  this->subtitlesPacket.payloadLen = len;
+}
 
-    sendto(rtpSocket, packet + 4, packetOffset - 4, 0, (struct sockaddr*)&client_addr, sizeof(client_addr));
-  }
-  this->subtitlesSequenceNumber++;
-  this->subtitlesTimestamp += 1000; // Increment the timestamp
+void RTSPServer::sendRtpSubtitles(RTP_TrackState& track, bool useTCP, bool isMulticast) {
+  int rtpSocket = isMulticast ? this->subtitlesMulticastSocket : this->subtitlesUnicastSocket;
+  sendRtpPacket(this->subtitlesPacket, track, rtpSocket, useTCP);
+  sendSenderReport(track, 1000, 0, isMulticast ? rtpSocket : this->subtitlesRtcpSocket, useTCP);
 }
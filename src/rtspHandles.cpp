@@ -15,21 +15,9 @@ void RTSPServer::wrapInHTTP(char* buffer, size_t len, char* response, size_t max
 /**
  * @brief Handles the OPTIONS RTSP request.
  * 
- * @param request The RTSP request.
  * @param session The RTSP session.
  */
-
-void RTSPServer::handleOptions(char* request, RTSP_Session& session) {
-  char* urlStart = strstr(request, "rtsp://");
-  if (urlStart) {
-    char* pathStart = strchr(urlStart + 7, '/');
-    char* pathEnd = strchr(pathStart, ' ');
-    if (pathStart && pathEnd) {
-      *pathEnd = 0; // Null-terminate the path
-      // Path can be processed here if needed
-    }
-  }
-  
+void RTSPServer::handleOptions(RTSP_Session& session) {
   char response[512];
   const char* publicMethods = "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN\r\n\r\n";
   
@@ -45,9 +33,9 @@ void RTSPServer::handleOptions(char* request, RTSP_Session& session) {
   if (session.isHttp) {
     char httpResponse[1024];
     wrapInHTTP(response, strlen(response), httpResponse, sizeof(httpResponse));
-    write(session.httpSock, httpResponse, strlen(httpResponse));
+    sendResponse(session, httpResponse, strlen(httpResponse));
   } else {
-    write(session.sock, response, strlen(response));
+    sendResponse(session, response, strlen(response));
   }
 }
 
@@ -57,7 +45,7 @@ void RTSPServer::handleOptions(char* request, RTSP_Session& session) {
  * @param session The RTSP session.
  */
 void RTSPServer::handleDescribe(const RTSP_Session& session) {
-  char sdpDescription[512];
+  char sdpDescription[768];
   int sdpLen = snprintf(sdpDescription, sizeof(sdpDescription),
                         "v=0\r\n"
                         "o=- %ld 1 IN IP4 %s\r\n"
@@ -66,11 +54,42 @@ void RTSPServer::handleDescribe(const RTSP_Session& session) {
                         "t=0 0\r\n"
                         "a=control:*\r\n",
                         session.sessionID, WiFi.localIP().toString().c_str());
+  bool useFec = isVideo && this->fecGroupSize;
+  if (useFec) {
+    // RFC 5956 grouping of the video stream and its parity stream
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen, "a=group:FEC-FR video fec\r\n");
+  }
 
   if (isVideo) {
+#ifdef RTSP_VIDEO_NACK
+    // AVPF so UDP receivers NACK lost packets, resent as RTX
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen, "m=video 0 RTP/AVPF 26 %d", RTP_RTX_PAYLOAD_TYPE);
+#else
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen, "m=video 0 RTP/AVP 26");
+#endif
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen, "\r\n");
+#ifdef RTSP_VIDEO_NACK
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
+                       "a=rtpmap:26 JPEG/90000\r\n"
+                       "a=rtpmap:%d rtx/90000\r\n"
+                       "a=fmtp:%d apt=26\r\n"
+                       "a=rtcp-fb:26 nack\r\n",
+                       RTP_RTX_PAYLOAD_TYPE, RTP_RTX_PAYLOAD_TYPE);
+#endif
+    if (useFec) {
+      sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen, "a=mid:video\r\n");
+    }
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen, "a=control:video\r\n");
+  }
+
+  if (useFec) {
+    // Parity packets as their own stream, only sent to the multicast group
     sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
-                       "m=video 0 RTP/AVP 26\r\n"
-                       "a=control:video\r\n");
+                       "m=video 0 RTP/AVP %d\r\n"
+                       "a=rtpmap:%d ulpfec/90000\r\n"
+                       "a=mid:fec\r\n"
+                       "a=control:fec\r\n",
+                       RTP_FEC_PAYLOAD_TYPE, RTP_FEC_PAYLOAD_TYPE);
   }
 
   const char* mediaCondition = "sendrecv"; 
@@ -81,10 +100,14 @@ void RTSPServer::handleDescribe(const RTSP_Session& session) {
 
   if (isAudio) {
     sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
-                       "m=audio 0 RTP/AVP 97\r\n"
-                       "a=rtpmap:97 L16/%lu/1\r\n"
+                       "m=audio 0 RTP/AVP %d\r\n"
+                       "a=rtpmap:%d %s/%lu/1\r\n"
                        "a=control:audio\r\n"
-                       "a=%s\r\n", sampleRate, mediaCondition);
+                       "a=%s\r\n", audioPayloadType(), audioPayloadType(), audioEncodingName(), sampleRate, mediaCondition);
+  }
+  if (isAudio && this->audioPtime) {
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
+                       "a=ptime:%u\r\n", this->audioPtime);
   }
 
   if (isSubtitles) {
@@ -100,18 +123,21 @@ void RTSPServer::handleDescribe(const RTSP_Session& session) {
                              "%s",
                              session.cseq, dateHeader(), WiFi.localIP().toString().c_str(), sdpLen, sdpDescription);
   
-  write(session.isHttp ? session.httpSock : session.sock, response, responseLen);
+  sendResponse(session, response, responseLen);
 }
 
 /**
  * @brief Handles the SETUP RTSP request.
  * 
- * @param request The RTSP request.
+ * @param request The parsed RTSP request.
  * @param session The RTSP session.
  */
-void RTSPServer::handleSetup(char* request, RTSP_Session& session) {
-  session.isMulticast = strstr(request, "multicast") != NULL;
-  session.isTCP = strstr(request, "RTP/AVP/TCP") != NULL;
+void RTSPServer::handleSetup(const RTSP_Request& request, RTSP_Session& session) {
+  RTSP_Transport transport;
+  parseTransport(request.headers[RTSP_HEADER_TRANSPORT], transport);
+  session.isMulticast = transport.isMulticast;
+  session.isTCP = transport.isTCP;
+  const char* profile = transport.isAVPF ? "RTP/AVPF" : "RTP/AVP"; // Answer with the profile asked for
 
 #ifndef OVERRIDE_RTSP_SINGLE_CLIENT_MODE
   // Track the first client's connection type
@@ -150,56 +176,53 @@ void RTSPServer::handleSetup(char* request, RTSP_Session& session) {
   setMaxClients(this->maxRTSPClients);
 #endif
 
-  bool setVideo = strstr(request, "video") != NULL;
-  bool setAudio = strstr(request, "audio") != NULL;
-  bool setSubtitles = strstr(request, "subtitles") != NULL;
+  bool setVideo = spanEquals(request.track, "video");
+  bool setAudio = spanEquals(request.track, "audio");
+  bool setSubtitles = spanEquals(request.track, "subtitles");
+  bool setFec = spanEquals(request.track, "fec");
   uint16_t clientPort = 0;
   uint16_t serverPort = 0;
   uint8_t rtpChannel = 0;
 
   // Extract client port or RTP channel based on transport method
   if (session.isTCP) {
-    char* interleaveStart = strstr(request, "interleaved=");
-    if (interleaveStart) {
-      interleaveStart += 12;
-      char* interleaveEnd = strchr(interleaveStart, '-');
-      if (interleaveStart && interleaveEnd) {
-        *interleaveEnd = 0;
-        rtpChannel = atoi(interleaveStart);
-        RTSP_LOGD(LOG_TAG, "Extracted RTP channel: %d", rtpChannel);
-      } else {
-        RTSP_LOGE(LOG_TAG, "Failed to find interleave end");
-      }
+    if (transport.hasInterleaved) {
+      rtpChannel = transport.interleaved;
+      RTSP_LOGD(LOG_TAG, "Extracted RTP channel: %d", rtpChannel);
     } else {
       RTSP_LOGE(LOG_TAG, "Failed to find interleaved=");
     }
   } else if (!session.isMulticast) {
-    char* rtpPortStart = strstr(request, "client_port=");
-    if (rtpPortStart) {
-      rtpPortStart += 12;
-      char* rtpPortEnd = strchr(rtpPortStart, '-');
-      if (rtpPortStart && rtpPortEnd) {
-        *rtpPortEnd = 0;
-        clientPort = atoi(rtpPortStart);
-        RTSP_LOGD(LOG_TAG, "Extracted client port: %d", clientPort);
-      } else {
-        RTSP_LOGE(LOG_TAG, "Failed to find client port end");
-      }
+    if (transport.clientPort) {
+      clientPort = transport.clientPort;
+      RTSP_LOGD(LOG_TAG, "Extracted client port: %d", clientPort);
     } else {
       RTSP_LOGE(LOG_TAG, "Failed to find client_port=");
     }
   }
 
+  // Resolve a unicast client's address once, the senders use the address cached in the track
+  uint32_t destinationIp = session.isTCP || session.isMulticast ? 0 : clientDestinationIp(session);
+
+  // TCP and HTTP tunnels are not limited by the MTU
+  session.maxPayload = session.isTCP ? RTP_TCP_MAX_PAYLOAD : udpMaxPayload();
+  session.audioMaxPayload = session.maxPayload;
+
   // Setup video, audio, or subtitles based on the request
   if (setVideo) {
     session.cVideoPort = clientPort;
     serverPort = this->rtpVideoPort;
-    this->videoCh = rtpChannel;
+    initTrackState(session.videoTrack, rtpChannel);
     if (!session.isTCP) {
       if (session.isMulticast) {
         this->checkAndSetupUDP(this->videoMulticastSocket, true, serverPort, this->rtpIp);
       } else {
+        setTrackDestination(session.videoTrack, destinationIp, clientPort);
         this->checkAndSetupUDP(this->videoUnicastSocket, false, serverPort, this->rtpIp);
+        this->checkAndSetupUDP(this->videoRtcpSocket, false, serverPort + 1, this->rtpIp);
+#ifdef RTSP_VIDEO_NACK
+        startHistory(session.videoTrack);
+#endif
       }
     }
   }
@@ -207,12 +230,14 @@ void RTSPServer::handleSetup(char* request, RTSP_Session& session) {
   if (setAudio) {
     session.cAudioPort = clientPort;
     serverPort = this->rtpAudioPort;
-    this->audioCh = rtpChannel;
+    initTrackState(session.audioTrack, rtpChannel);
     if (!session.isTCP) {
       if (session.isMulticast) {
         this->checkAndSetupUDP(this->audioMulticastSocket, true, serverPort, this->rtpIp);
       } else {
+        setTrackDestination(session.audioTrack, destinationIp, clientPort);
         this->checkAndSetupUDP(this->audioUnicastSocket, false, serverPort, this->rtpIp);
+        this->checkAndSetupUDP(this->audioRtcpSocket, false, serverPort + 1, this->rtpIp);
       }
     }
   }
@@ -220,16 +245,44 @@ void RTSPServer::handleSetup(char* request, RTSP_Session& session) {
   if (setSubtitles) {
     session.cSrtPort = clientPort;
     serverPort = this->rtpSubtitlesPort;
-    this->subtitlesCh = rtpChannel;
+    initTrackState(session.subtitlesTrack, rtpChannel);
     if (!session.isTCP) {
       if (session.isMulticast) {
         this->checkAndSetupUDP(this->subtitlesMulticastSocket, true, serverPort, this->rtpIp);
       } else {
+        setTrackDestination(session.subtitlesTrack, destinationIp, clientPort);
         this->checkAndSetupUDP(this->subtitlesUnicastSocket, false, serverPort, this->rtpIp);
+        this->checkAndSetupUDP(this->subtitlesRtcpSocket, false, serverPort + 1, this->rtpIp);
       }
     }
   }
 
+  if (setFec) {
+    // Parity is sent from the video multicast socket to the group only, other transports get an idle stream
+    serverPort = this->rtpFecPort;
+  }
+
+  // Interleaved packets go through the slot's queue so a slow client never blocks the senders
+  if (session.isTCP && (setVideo || setAudio || setSubtitles)) {
+    RTSP_EgressQueue& queue = this->egressQueues[&session - this->sessions];
+    int sock = session.isHttp ? session.httpSock : session.sock;
+    if (queue.sock != sock) {
+      startEgressQueue(queue, sock);
+    }
+    RTP_TrackState& track = setVideo ? session.videoTrack : (setAudio ? session.audioTrack : session.subtitlesTrack);
+    track.egress = &queue;
+    track.egressClass = setVideo ? RTSP_EGRESS_VIDEO : (setAudio ? RTSP_EGRESS_AUDIO : RTSP_EGRESS_DATA);
+    // Packets are only queued whole, two audio packets must fit the audio ring.
+    // Video frames are checked whole against the video ring, which grows to fit them.
+    size_t audioRingSize = queue.rings[RTSP_EGRESS_AUDIO].size;
+    if (queue.buffer != NULL && session.audioMaxPayload > audioRingSize / 2) {
+      session.audioMaxPayload = audioRingSize / 2;
+    }
+  }
+
+  if (setAudio && this->audioPtime) {
+    startAudioRing();
+  }
 
 #ifdef RTSP_VIDEO_NONBLOCK
   if (setVideo && this->rtpVideoTaskHandle == NULL) {
@@ -252,23 +305,22 @@ void RTSPServer::handleSetup(char* request, RTSP_Session& session) {
              "RTSP/1.0 200 OK\r\n"
              "CSeq: %d\r\n"
              "%s\r\n"
-             "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d\r\n"
+             "Transport: %s/TCP;unicast;interleaved=%d-%d\r\n"
              "Session: %lu\r\n\r\n",
-             session.cseq, dateHeader(), rtpChannel, rtpChannel + 1, session.sessionID);
+             session.cseq, dateHeader(), profile, rtpChannel, rtpChannel + 1, session.sessionID);
   } else if (session.isMulticast) {
     snprintf(response, 512,
-             "RTSP/1.0 200 OK\r\nCSeq: %d\r\n%s\r\nTransport: RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d\r\nSession: %lu\r\n\r\n",
-             session.cseq, dateHeader(), this->rtpIp.toString().c_str(), serverPort, serverPort + 1, this->rtpTTL, session.sessionID);
+             "RTSP/1.0 200 OK\r\nCSeq: %d\r\n%s\r\nTransport: %s;multicast;destination=%s;port=%d-%d;ttl=%d\r\nSession: %lu\r\n\r\n",
+             session.cseq, dateHeader(), profile, this->rtpIp.toString().c_str(), serverPort, serverPort + 1, this->rtpTTL, session.sessionID);
   } else {
     snprintf(response, 512,
-             "RTSP/1.0 200 OK\r\nCSeq: %d\r\n%s\r\nTransport: RTP/AVP;unicast;destination=127.0.0.1;source=127.0.0.1;client_port=%d-%d;server_port=%d-%d\r\nSession: %lu\r\n\r\n",
-             session.cseq, dateHeader(), clientPort, clientPort + 1, serverPort, serverPort + 1, session.sessionID);
+             "RTSP/1.0 200 OK\r\nCSeq: %d\r\n%s\r\nTransport: %s;unicast;destination=127.0.0.1;source=127.0.0.1;client_port=%d-%d;server_port=%d-%d\r\nSession: %lu\r\n\r\n",
+             session.cseq, dateHeader(), profile, clientPort, clientPort + 1, serverPort, serverPort + 1, session.sessionID);
   }
 
-  write(session.isHttp ? session.httpSock : session.sock, response, strlen(response));
+  sendResponse(session, response, strlen(response));
   
   free(response);
-  this->sessions[session.sessionID] = session;
 }
 
 /**
@@ -278,8 +330,9 @@ void RTSPServer::handleSetup(char* request, RTSP_Session& session) {
  */
 void RTSPServer::handlePlay(RTSP_Session& session) {
   session.isPlaying = true;
-  this->sessions[session.sessionID] = session;
-  setIsPlaying(true);
+  this->qTablesPending = true; // New receivers need the JPEG quantization tables
+  this->audioMarker = true; // and start a talkspurt
+  updateIsPlayingStatus();
 
   char response[256];
   snprintf(response, sizeof(response),
@@ -293,7 +346,7 @@ void RTSPServer::handlePlay(RTSP_Session& session) {
            dateHeader(),
            session.sessionID);
 
-  write(session.isHttp ? session.httpSock : session.sock, response, strlen(response));
+  sendResponse(session, response, strlen(response));
 }
 
 /**
@@ -303,14 +356,13 @@ void RTSPServer::handlePlay(RTSP_Session& session) {
  */
 void RTSPServer::handlePause(RTSP_Session& session) {
   session.isPlaying = false;
-  this->sessions[session.sessionID] = session;
   updateIsPlayingStatus();
   char response[128];
   int len = snprintf(response, sizeof(response),
                      "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %lu\r\n\r\n",
                      session.cseq, session.sessionID);
   
-  write(session.isHttp ? session.httpSock : session.sock, response, len);
+  sendResponse(session, response, len);
   RTSP_LOGD(LOG_TAG, "Session %u is now paused.", session.sessionID);
 }
 
@@ -321,7 +373,6 @@ void RTSPServer::handlePause(RTSP_Session& session) {
  */
 void RTSPServer::handleTeardown(RTSP_Session& session) {
   session.isPlaying = false;
-  this->sessions[session.sessionID] = session;
   updateIsPlayingStatus();
 
   char response[128];
@@ -329,47 +380,41 @@ void RTSPServer::handleTeardown(RTSP_Session& session) {
                      "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %lu\r\n\r\n",
                      session.cseq, session.sessionID);
   
-  write(session.isHttp ? session.httpSock : session.sock, response, len);
+  sendResponse(session, response, len);
 
   RTSP_LOGD(LOG_TAG, "RTSP Session %u has been torn down.", session.sessionID);
 }
 
 /**
- * @brief Handles incoming RTSP requests.
+ * @brief Reads from an RTSP connection and handles every complete request received.
+ * 
+ * The received bytes are kept in the connection's buffer across reads, so a
+ * request split over several TCP segments is handled once it is complete, and
+ * pipelined requests in one segment are handled in order.
  * 
- * @param sock The socket file descriptor.
- * @param clientAddr The client address.
- * @return true if the request was handled successfully, false otherwise.
+ * @param session The RTSP session of the connection.
+ * @param recvBuffer The connection's receive buffer.
+ * @return true to keep the connection, false to close it.
  */
-bool RTSPServer::handleRTSPRequest(RTSP_Session& session) {
-  char *buffer = (char *)ps_malloc(RTSP_BUFFER_SIZE);
-  if (!buffer) {
-    RTSP_LOGE(LOG_TAG, "Failed to allocate buffer with ps_malloc");
+bool RTSPServer::handleRTSPRequest(RTSP_Session& session, RTSP_RecvBuffer& recvBuffer) {
+  if (recvBuffer.data == NULL) {
     return false;
   }
 
-  int totalLen = 0;
-  int len = 0;
-
-  // Read data from socket until end of RTSP header or buffer limit is reached
-  while ((len = recv(session.sock, buffer + totalLen, RTSP_BUFFER_SIZE - totalLen - 1, 0)) > 0) {
-    totalLen += len;
-    if (strstr(buffer, "\r\n\r\n")) {
-      break;
-    }
-    if (totalLen >= RTSP_BUFFER_SIZE) { // Adjusted for null-terminator
-      RTSP_LOGE(LOG_TAG, "Request too large for buffer. Total length: %d", totalLen);
-      free(buffer); // Free allocated memory
-      return false;
-    }
+  // A base64 group split by the last read is completed by this one
+  char* buffer = recvBuffer.data + recvBuffer.len;
+  size_t carried = recvBuffer.base64Len;
+  if ((size_t)(RTSP_BUFFER_SIZE - recvBuffer.len - 1) <= carried) {
+    RTSP_LOGE(LOG_TAG, "Request too large for buffer. Total length: %d", recvBuffer.len);
+    return false;
   }
-
-  if (totalLen <= 0) {
+  memcpy(buffer, recvBuffer.base64Tail, carried);
+  int len = recv(session.sock, buffer + carried, RTSP_BUFFER_SIZE - recvBuffer.len - carried - 1, 0);
+  if (len <= 0) {
     int err = errno;
-    free(buffer);
-    if (err == EWOULDBLOCK || err == EAGAIN) {
+    if (len < 0 && (err == EWOULDBLOCK || err == EAGAIN)) {
       return true;
-    } else if (err == ECONNRESET || err == ENOTCONN) {
+    } else if (len == 0 || err == ECONNRESET || err == ENOTCONN) {
       RTSP_LOGD(LOG_TAG, "Connection reset/closed - HandleTeardown");
       // Handle teardown for current session
       this->handleTeardown(session);
@@ -390,98 +435,162 @@ bool RTSPServer::handleRTSPRequest(RTSP_Session& session) {
     }
   }
 
-  // Check to see if RTCP packet and ignore for now...
-  buffer[totalLen] = 0; // Null-terminate the buffer
-  if (buffer[0] == '$') {
-    free(buffer); // Free allocated memory
-    return true; 
+  // Requests tunnelled over HTTP POST arrive base64 encoded, decode them in place.
+  // TCP may split a 4 character group, only whole groups are decoded and the rest is kept
+  size_t encodedLen = carried + len;
+  if (session.isHttp && isBase64Encoded(buffer, encodedLen)) {
+    RTSP_LOGD(LOG_TAG, "Buffer is base64 encoded, decoding...");
+    size_t groupsLen = encodedLen & ~(size_t)3;
+    recvBuffer.base64Len = encodedLen - groupsLen;
+    memcpy(recvBuffer.base64Tail, buffer + groupsLen, recvBuffer.base64Len);
+    size_t decodedLen = 0;
+    size_t runStart = 0;
+    for (size_t groupEnd = 4; groupEnd <= groupsLen; groupEnd += 4) {
+      // libb64 skips '=', a request encoded after a padded one needs a fresh decode
+      if (buffer[groupEnd - 1] == '=' || groupEnd == groupsLen) {
+        size_t runLen;
+        if (!decodeBase64(buffer + runStart, groupEnd - runStart, buffer + decodedLen, &runLen)) {
+          RTSP_LOGE(LOG_TAG, "Failed to decode base64 buffer");
+          return false;
+        }
+        decodedLen += runLen;
+        runStart = groupEnd;
+      }
+    }
+    len = decodedLen;
+  } else if (carried) {
+    RTSP_LOGE(LOG_TAG, "Base64 tunnel data ended in a partial group");
+    return false;
   }
+  recvBuffer.len += len;
+  recvBuffer.data[recvBuffer.len] = 0; // Null-terminate the buffer
 
-  uint8_t firstByte = buffer[0]; 
-  uint8_t version = (firstByte >> 6) & 0x03;
-  if (version == 2) { 
-    uint8_t payloadType = buffer[1] & 0x7F;
-    if (payloadType >= 200 && payloadType <= 204) {
-      free(buffer); // Free allocated memory
-      return true;
+  size_t pos = 0;
+  if (recvBuffer.skipLen) {
+    pos = recvBuffer.skipLen < recvBuffer.len ? recvBuffer.skipLen : recvBuffer.len;
+    recvBuffer.skipLen -= pos;
+  }
+  while (pos < recvBuffer.len) {
+    int used = dispatchRTSPData(session, recvBuffer, recvBuffer.data + pos, recvBuffer.len - pos);
+    if (used == 0) {
+      break; // Wait for the rest
     }
-    free(buffer); // Free allocated memory
-    return true;
+    pos += used;
   }
+  recvBuffer.len -= pos;
+  memmove(recvBuffer.data, recvBuffer.data + pos, recvBuffer.len + 1);
 
-  // Check if the request is base64 encoded FIRST
-  RTSP_LOGD(LOG_TAG, "Checking if base64 encoded");
-  
-  if (isBase64Encoded(buffer, totalLen)) {
-    RTSP_LOGD(LOG_TAG, "Buffer is base64 encoded, decoding...");
-    char* decodedBuffer = (char*)malloc(RTSP_BUFFER_SIZE);
-    if (!decodedBuffer) {
-      RTSP_LOGE(LOG_TAG, "Failed to allocate memory for decoded buffer");
-      free(buffer);
-      return false;
-    }
+  if (recvBuffer.len >= RTSP_BUFFER_SIZE - 1) {
+    RTSP_LOGE(LOG_TAG, "Request too large for buffer. Total length: %d", recvBuffer.len);
+    return false;
+  }
+  return true;
+}
 
-    size_t decodedLen;
-    if (decodeBase64(buffer, totalLen, decodedBuffer, &decodedLen)) {
-      RTSP_LOGD(LOG_TAG, "Decoded buffer: %s", decodedBuffer);
-      free(buffer);
-      buffer = decodedBuffer;
-      totalLen = decodedLen;
-    } else {
-      RTSP_LOGE(LOG_TAG, "Failed to decode base64 buffer");
-      free(decodedBuffer);
-      free(buffer);
-      return false;
+/**
+ * @brief Handles the first complete request or interleaved packet of the received data.
+ * 
+ * Interleaved packets, '$', channel and 16 bit length, are consumed exactly so
+ * requests sent after them in the same segment are not lost.
+ * 
+ * @param session The RTSP session of the connection.
+ * @param recvBuffer The connection's receive buffer.
+ * @param data The received data not handled yet.
+ * @param len Length of the data.
+ * @return Number of bytes handled, 0 if the data is not complete yet.
+ */
+int RTSPServer::dispatchRTSPData(RTSP_Session& session, RTSP_RecvBuffer& recvBuffer, char* data, size_t len) {
+  if (data[0] == '$') {
+    if (len < RTP_TCP_PREFIX_SIZE) {
+      return 0;
+    }
+    uint8_t channel = data[1];
+    size_t packetLen = ((uint8_t)data[2] << 8) | (uint8_t)data[3];
+    if (RTP_TCP_PREFIX_SIZE + packetLen >= RTSP_BUFFER_SIZE) {
+      RTSP_LOGW(LOG_TAG, "Dropping %u byte interleaved packet on channel %d", (unsigned)packetLen, channel);
+      if (len < RTP_TCP_PREFIX_SIZE + packetLen) {
+        recvBuffer.skipLen = RTP_TCP_PREFIX_SIZE + packetLen - len;
+        return len;
+      }
+      return RTP_TCP_PREFIX_SIZE + packetLen;
+    }
+    if (len < RTP_TCP_PREFIX_SIZE + packetLen) {
+      return 0;
     }
+    handleInterleaved(channel, (const uint8_t*)data + RTP_TCP_PREFIX_SIZE, packetLen);
+    return RTP_TCP_PREFIX_SIZE + packetLen;
   }
 
-  int cseq = captureCSeq(buffer);
-  if (cseq == -1) {
-    RTSP_LOGE(LOG_TAG, "CSeq not found in request: %s", buffer);
-    write(session.sock, "RTSP/1.0 400 Bad Request\r\n\r\n", 29);
-    free(buffer); // Free allocated memory
-    return true;
+  // Empty lines between requests
+  if (data[0] == '\r' || data[0] == '\n') {
+    return 1;
+  }
+
+  RTSP_Request request;
+  int requestLen = parseRTSPRequest(data, len, request);
+  if (requestLen == 0) {
+    return 0;
+  }
+  if (requestLen < 0) {
+    RTSP_LOGE(LOG_TAG, "Malformed request: %s", data);
+    sendResponse(session, "RTSP/1.0 400 Bad Request\r\n\r\n", 28);
+    return len; // Drop the rest, the stream cannot be resynchronized
   }
 
-  session.cseq = cseq;
+  bool isHttpMethod = request.method == RTSP_METHOD_HTTP_GET || request.method == RTSP_METHOD_HTTP_POST;
+  if (request.cseq == -1 && !isHttpMethod) {
+    RTSP_LOGE(LOG_TAG, "CSeq not found in request: %.*s", requestLen, data);
+    sendResponse(session, "RTSP/1.0 400 Bad Request\r\n\r\n", 28);
+    return requestLen;
+  }
+
+  processRTSPRequest(request, session);
+  return requestLen;
+}
 
-  // Extract session ID using the provided function
-  uint32_t sessionID = extractSessionID(buffer);
-  if (sessionID != 0 && sessions.find(sessionID) != sessions.end()) {
-    session.sessionID = sessionID;
+/**
+ * @brief Handles a parsed request, after checking its session and credentials.
+ * 
+ * @param request The parsed request.
+ * @param session The RTSP session of the connection.
+ */
+void RTSPServer::processRTSPRequest(const RTSP_Request& request, RTSP_Session& session) {
+  session.cseq = request.cseq;
+  if (request.sessionID != 0 && findSession(request.sessionID) == NULL) {
+    char response[128];
+    int len = snprintf(response, sizeof(response),
+                       "RTSP/1.0 454 Session Not Found\r\nCSeq: %d\r\n\r\n",
+                       session.cseq);
+    sendResponse(session, response, len);
+    return;
   }
 
   // Authentication check
   if (authEnabled) {
-    char* authHeader = strstr(buffer, "Authorization: Basic ");
-    if (!authHeader) {
+    const RTSP_Span& authHeader = request.headers[RTSP_HEADER_AUTHORIZATION];
+    bool authorized = false;
+    if (spanStartsWith(authHeader, "Basic ")) {
+      RTSP_Span credentials = {authHeader.data + 6, (uint16_t)(authHeader.len - 6)};
+      authorized = spanEquals(credentials, base64Credentials);
+    }
+    if (!authorized) {
       sendUnauthorizedResponse(session);
-      free(buffer); // Free allocated memory
-      return true;
-    } else {
-      authHeader += 21; // Move pointer to the base64 encoded credentials
-      char* authEnd = strstr(authHeader, "\r\n");
-      if (authEnd) {
-        *authEnd = 0; // Null-terminate the base64 string
-        if (strcmp(authHeader, base64Credentials) != 0) {
-          sendUnauthorizedResponse(session);
-          free(buffer); // Free allocated memory
-          return true;
-        } else {
-          // Remove the Authorization header from the buffer before continuing
-          memmove(authHeader - 21, authEnd + 2, strlen(authEnd + 2) + 1);
-        }
-      } else {
-        sendUnauthorizedResponse(session);
-        free(buffer); // Free allocated memory
-        return true;
-      }
+      return;
     }
   }
 
+  // Only a request that got this far may change the frame rate
+  if (request.fps) {
+    bool wasPlaying = holdSession(session);
+    session.maxFps = request.fps;
+    session.nextFrameTimestamp = this->videoTimestamp;
+    unholdSession(session, wasPlaying);
+    RTSP_LOGD(LOG_TAG, "Session %u limited to %d fps", session.sessionID, session.maxFps);
+  }
+
   // Handle HTTP tunneling methods first
-  if (strncmp(buffer, "GET / HTTP/", 10) == 0 && strstr(buffer, "Accept: application/x-rtsp-tunnelled")) {
-    RTSP_LOGD(LOG_TAG, "Handle GET HTTP Request: %s", buffer);
+  if (request.method == RTSP_METHOD_HTTP_GET && spanStartsWith(request.headers[RTSP_HEADER_ACCEPT], "application/x-rtsp-tunnelled")) {
+    RTSP_LOGD(LOG_TAG, "Handle GET HTTP Request: %.*s", request.url.len, request.url.data);
     
     // Increase max clients by 1 to account for HTTP tunneling
     uint8_t currentMaxClients = getMaxClients();
@@ -489,10 +598,8 @@ bool RTSPServer::handleRTSPRequest(RTSP_Session& session) {
     RTSP_LOGD(LOG_TAG, "Increased max clients to %d for HTTP tunneling", currentMaxClients + 1);
     
     session.isHttp = true;
-    char sessionCookie[MAX_COOKIE_LENGTH];
-    extractSessionCookie(buffer, sessionCookie, sizeof(sessionCookie));
-    strncpy(session.sessionCookie, sessionCookie, MAX_COOKIE_LENGTH - 1);
-    session.sessionCookie[MAX_COOKIE_LENGTH - 1] = '\0';
+    copySessionCookie(request.headers[RTSP_HEADER_COOKIE], session.sessionCookie, MAX_COOKIE_LENGTH);
+    session.cookieHash = hashCookie(session.sessionCookie);
 
     char response[512];
     snprintf(response, sizeof(response),
@@ -507,13 +614,12 @@ bool RTSPServer::handleRTSPRequest(RTSP_Session& session) {
              dateHeader());
     write(session.sock, response, strlen(response));  // Use direct socket for initial HTTP response
   }
-  else if (strncmp(buffer, "POST / HTTP/", 11) == 0 && strstr(buffer, "Content-Type: application/x-rtsp-tunnelled")) {
+  else if (request.method == RTSP_METHOD_HTTP_POST && spanStartsWith(request.headers[RTSP_HEADER_CONTENT_TYPE], "application/x-rtsp-tunnelled")) {
     RTSP_LOGD(LOG_TAG, "RTSP-over-HTTP Tunnel Established");
-    RTSP_LOGD(LOG_TAG, "Handle POST HTTP Request: %s", buffer);
     
     // Extract cookie from POST request
     char sessionCookie[MAX_COOKIE_LENGTH];
-    extractSessionCookie(buffer, sessionCookie, sizeof(sessionCookie));
+    copySessionCookie(request.headers[RTSP_HEADER_COOKIE], sessionCookie, sizeof(sessionCookie));
     
     // Find corresponding GET session
     RTSP_Session* getSession = findSessionByCookie(sessionCookie);
@@ -523,16 +629,15 @@ bool RTSPServer::handleRTSPRequest(RTSP_Session& session) {
         session.isHttp = true;
         strncpy(session.sessionCookie, sessionCookie, MAX_COOKIE_LENGTH - 1);
         session.sessionCookie[MAX_COOKIE_LENGTH - 1] = '\0';
+        session.cookieHash = hashCookie(session.sessionCookie);
     } else {
         RTSP_LOGE(LOG_TAG, "No matching GET session found for cookie: %s", sessionCookie);
     }
   } else {
     // Handle regular RTSP commands
-    handleRTSPCommand(buffer, session);
+    handleRTSPCommand(request, session);
   }
 
-  free(buffer);
-  return true;
 }
 
 void RTSPServer::sendUnauthorizedResponse(RTSP_Session& session) {
@@ -543,31 +648,42 @@ void RTSPServer::sendUnauthorizedResponse(RTSP_Session& session) {
            "WWW-Authenticate: Basic realm=\"ESP32\"\r\n\r\n",
            session.cseq);
   
-  write(session.isHttp ? session.httpSock : session.sock, response, strlen(response));
+  sendResponse(session, response, strlen(response));
   RTSP_LOGW(LOG_TAG, "Sent 401 Unauthorized response to client.");
 }
 
-void RTSPServer::handleRTSPCommand(char* command, RTSP_Session& session) {
-  if (strncmp(command, "OPTIONS", 7) == 0) {
-    RTSP_LOGD(LOG_TAG, "Handle RTSP Options");
-    handleOptions(command, session);
-  } else if (strncmp(command, "DESCRIBE", 8) == 0) {
-    RTSP_LOGD(LOG_TAG, "Handle RTSP Describe");
-    handleDescribe(session);
-  } else if (strncmp(command, "SETUP", 5) == 0) {
-    RTSP_LOGD(LOG_TAG, "Handle RTSP Setup");
-    handleSetup(command, session);
-  } else if (strncmp(command, "PLAY", 4) == 0) {
-    RTSP_LOGD(LOG_TAG, "Handle RTSP Play");
-    handlePlay(session);
-  } else if (strncmp(command, "TEARDOWN", 8) == 0) {
-    RTSP_LOGD(LOG_TAG, "Handle RTSP Teardown");
-    handleTeardown(session);
-  } else if (strncmp(command, "PAUSE", 5) == 0) {
-    RTSP_LOGD(LOG_TAG, "Handle RTSP Pause");
-    handlePause(session);
-  } else {
-    RTSP_LOGW(LOG_TAG, "Unknown RTSP method: %s", command);
+void RTSPServer::handleRTSPCommand(const RTSP_Request& request, RTSP_Session& session) {
+  switch (request.method) {
+    case RTSP_METHOD_OPTIONS:
+      RTSP_LOGD(LOG_TAG, "Handle RTSP Options");
+      handleOptions(session);
+      break;
+    case RTSP_METHOD_DESCRIBE:
+      RTSP_LOGD(LOG_TAG, "Handle RTSP Describe");
+      handleDescribe(session);
+      break;
+    case RTSP_METHOD_SETUP: {
+      RTSP_LOGD(LOG_TAG, "Handle RTSP Setup");
+      bool wasPlaying = holdSession(session); // SETUP restarts tracks the senders may be using
+      handleSetup(request, session);
+      unholdSession(session, wasPlaying);
+      break;
+    }
+    case RTSP_METHOD_PLAY:
+      RTSP_LOGD(LOG_TAG, "Handle RTSP Play");
+      handlePlay(session);
+      break;
+    case RTSP_METHOD_TEARDOWN:
+      RTSP_LOGD(LOG_TAG, "Handle RTSP Teardown");
+      handleTeardown(session);
+      break;
+    case RTSP_METHOD_PAUSE:
+      RTSP_LOGD(LOG_TAG, "Handle RTSP Pause");
+      handlePause(session);
+      break;
+    default:
+      RTSP_LOGW(LOG_TAG, "Unknown RTSP method for %.*s", request.url.len, request.url.data);
+      break;
   }
 }
 
@@ -579,11 +695,7 @@ bool RTSPServer::isBase64Encoded(const char* buffer, size_t length) {
         }
     }
 
-    // Now check if it's valid base64
-    if (length % 4 != 0) {
-        return false;
-    }
-
+    // Now check if it's valid base64, reads may end inside a 4 character group
     for (size_t i = 0; i < length; i++) {
         if (!isalnum(buffer[i]) && 
             buffer[i] != '+' && 
@@ -596,25 +708,19 @@ bool RTSPServer::isBase64Encoded(const char* buffer, size_t length) {
     return true;
 }
 
-void RTSPServer::extractSessionCookie(const char* buffer, char* sessionCookie, size_t maxLen) {
-    const char* cookieHeader = strstr(buffer, "x-sessioncookie:");
-    if (cookieHeader) {
-        cookieHeader += strlen("x-sessioncookie:");
-        while (*cookieHeader == ' ') cookieHeader++;
-        const char* end = strstr(cookieHeader, "\r\n");
-        size_t len = end ? (size_t)(end - cookieHeader) : strlen(cookieHeader);
-        len = len < maxLen ? len : maxLen - 1;
-        strncpy(sessionCookie, cookieHeader, len);
-        sessionCookie[len] = '\0';
-    } else {
-        sessionCookie[0] = '\0';
+void RTSPServer::copySessionCookie(const RTSP_Span& cookie, char* sessionCookie, size_t maxLen) {
+    size_t len = cookie.len < maxLen ? cookie.len : maxLen - 1;
+    if (len) {
+        memcpy(sessionCookie, cookie.data, len);
     }
+    sessionCookie[len] = '\0';
 }
 
 RTSP_Session* RTSPServer::findSessionByCookie(const char* cookie) {
-    for (auto& pair : sessions) {
-        if (strcmp(pair.second.sessionCookie, cookie) == 0) {
-            return &pair.second;
+    uint32_t hash = hashCookie(cookie);
+    for (RTSP_Session& session : sessions) {
+        if (session.inUse && session.cookieHash == hash && strcmp(session.sessionCookie, cookie) == 0) {
+            return &session;
         }
     }
     return nullptr;
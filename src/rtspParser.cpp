@@ -0,0 +1,320 @@
+#include "ESP32-RTSPServer.h"
+
+struct RTSP_MethodName {
+  const char* name;
+  uint8_t len;
+  RTSP_Method method;
+};
+
+static const RTSP_MethodName methodNames[] = {
+  {"OPTIONS", 7, RTSP_METHOD_OPTIONS},
+  {"DESCRIBE", 8, RTSP_METHOD_DESCRIBE},
+  {"SETUP", 5, RTSP_METHOD_SETUP},
+  {"PLAY", 4, RTSP_METHOD_PLAY},
+  {"PAUSE", 5, RTSP_METHOD_PAUSE},
+  {"TEARDOWN", 8, RTSP_METHOD_TEARDOWN},
+  {"GET", 3, RTSP_METHOD_HTTP_GET},
+  {"POST", 4, RTSP_METHOD_HTTP_POST},
+};
+
+struct RTSP_HeaderName {
+  const char* name;  // Lower case
+  uint8_t len;
+  RTSP_HeaderId id;
+};
+
+// Grouped by first letter for findHeader()
+static const RTSP_HeaderName headerNames[] = {
+  {"accept", 6, RTSP_HEADER_ACCEPT},
+  {"authorization", 13, RTSP_HEADER_AUTHORIZATION},
+  {"cseq", 4, RTSP_HEADER_CSEQ},
+  {"content-type", 12, RTSP_HEADER_CONTENT_TYPE},
+  {"content-length", 14, RTSP_HEADER_CONTENT_LENGTH},
+  {"session", 7, RTSP_HEADER_SESSION},
+  {"transport", 9, RTSP_HEADER_TRANSPORT},
+  {"x-sessioncookie", 15, RTSP_HEADER_COOKIE},
+};
+
+static inline char lowerAscii(char c) {
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/**
+ * @brief Finds the known header a line starts with, ignoring case.
+ *
+ * The first letter picks the candidates and the ':' must follow right after a
+ * candidate's name, only then is the name compared. Lines of headers the server
+ * does not read are never searched for their ':'.
+ *
+ * @param line The header line.
+ * @param len Length of the line without its line break.
+ * @return The header, or NULL if the server does not read it.
+ */
+static const RTSP_HeaderName* findHeader(const char* line, size_t len) {
+  size_t first, count;
+  switch (line[0] | 0x20) { // Lower case for letters, the names start with one
+    case 'a': first = 0; count = 2; break;
+    case 'c': first = 2; count = 3; break;
+    case 's': first = 5; count = 1; break;
+    case 't': first = 6; count = 1; break;
+    case 'x': first = 7; count = 1; break;
+    default: return NULL;
+  }
+  for (const RTSP_HeaderName* header = headerNames + first; header < headerNames + first + count; header++) {
+    if (len <= header->len || line[header->len] != ':') {
+      continue;
+    }
+    size_t i = 1;
+    while (i < header->len && lowerAscii(line[i]) == header->name[i]) {
+      i++;
+    }
+    if (i == header->len) {
+      return header;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Reads the decimal number at the start of a span.
+ *
+ * @return true if the span starts with a digit.
+ */
+static bool parseNumber(const char* data, size_t len, uint32_t& value) {
+  size_t i = 0;
+  value = 0;
+  while (i < len && data[i] >= '0' && data[i] <= '9') {
+    value = value * 10 + (data[i] - '0');
+    i++;
+  }
+  return i > 0;
+}
+
+static bool startsWith(const char* data, size_t len, const char* prefix, size_t prefixLen) {
+  return len >= prefixLen && memcmp(data, prefix, prefixLen) == 0;
+}
+
+/**
+ * @brief Splits a request URL into its path, query and track.
+ *
+ * rtsp://host:554/video?fps=10 has the path /video, the query fps=10 and the track video.
+ */
+static void splitUrl(RTSP_Request& request) {
+  const char* url = request.url.data;
+  const char* end = url + request.url.len;
+  const char* path = url;
+  const char* scheme = url;
+  while (scheme < end && *scheme != ':' && *scheme != '/') {
+    scheme++;
+  }
+  if (end - scheme >= 3 && scheme[0] == ':' && scheme[1] == '/' && scheme[2] == '/') {
+    path = (const char*)memchr(scheme + 3, '/', end - scheme - 3);
+    if (path == NULL) {
+      path = end;
+    }
+  }
+  // One walk finds both the query and the last path segment
+  const char* pathEnd = path;
+  const char* track = path;
+  while (pathEnd < end && *pathEnd != '?') {
+    if (*pathEnd == '/') {
+      track = pathEnd + 1;
+    }
+    pathEnd++;
+  }
+  request.path.data = path;
+  request.path.len = pathEnd - path;
+  if (pathEnd < end) {
+    request.query.data = pathEnd + 1;
+    request.query.len = end - pathEnd - 1;
+  }
+  request.track.data = track;
+  request.track.len = pathEnd - track;
+}
+
+/**
+ * @brief Reads the fps=N parameter of a URL query.
+ *
+ * @return The frame rate, at most 255, or 0 if the query has none.
+ */
+static uint8_t parseQueryFps(const RTSP_Span& query) {
+  const char* param = query.data;
+  const char* end = query.data + query.len;
+  while (param < end) {
+    const char* paramEnd = (const char*)memchr(param, '&', end - param);
+    if (paramEnd == NULL) {
+      paramEnd = end;
+    }
+    uint32_t fps;
+    if (startsWith(param, paramEnd - param, "fps=", 4) && parseNumber(param + 4, paramEnd - param - 4, fps)) {
+      return fps > 255 ? 255 : fps;
+    }
+    param = paramEnd + 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Parses one RTSP or HTTP tunnelling request in a single pass, without copying it.
+ *
+ * The spans in the request point into the data, which is left unchanged.
+ *
+ * @param data The received data, starting at the request line.
+ * @param len Length of the data.
+ * @param request Filled with the method, URL parts and the known headers.
+ * @return Length of the request including any body, 0 if more data is needed,
+ *         or -1 if it is not a request.
+ */
+int RTSPServer::parseRTSPRequest(const char* data, size_t len, RTSP_Request& request) {
+  // Only what a request may leave unset is cleared, not the whole struct
+  request.method = RTSP_METHOD_UNKNOWN;
+  request.query = {NULL, 0};
+  request.body = {NULL, 0};
+  memset(request.headers, 0, sizeof(request.headers));
+  request.cseq = -1;
+  request.sessionID = 0;
+  const char* end = data + len;
+
+  // Request line: method, URL and version
+  const char* lineEnd = (const char*)memchr(data, '\n', len);
+  if (lineEnd == NULL) {
+    return 0;
+  }
+  const char* url = NULL;
+  for (const RTSP_MethodName& method : methodNames) {
+    if ((size_t)(lineEnd - data) <= method.len || data[method.len] != ' ' || data[0] != method.name[0]) {
+      continue;
+    }
+    if (memcmp(data, method.name, method.len) == 0) {
+      request.method = method.method;
+      url = data + method.len + 1;
+      break;
+    }
+  }
+  if (url == NULL) {
+    const char* methodEnd = (const char*)memchr(data, ' ', lineEnd - data);
+    if (methodEnd == NULL) {
+      return -1;
+    }
+    url = methodEnd + 1;
+  }
+  // The version is short and last, the URL ends at the space before it
+  const char* urlEnd = lineEnd;
+  while (urlEnd > url && urlEnd[-1] != ' ') {
+    urlEnd--;
+  }
+  if (urlEnd == url) {
+    return -1;
+  }
+  urlEnd--;
+  request.url.data = url;
+  request.url.len = urlEnd - url;
+  splitUrl(request);
+  request.fps = parseQueryFps(request.query);
+
+  // Header lines up to the empty line
+  const char* line = lineEnd + 1;
+  while (true) {
+    lineEnd = (const char*)memchr(line, '\n', end - line);
+    if (lineEnd == NULL) {
+      return 0;
+    }
+    const char* valueEnd = lineEnd;
+    if (valueEnd > line && valueEnd[-1] == '\r') {
+      valueEnd--;
+    }
+    if (valueEnd == line) {
+      break;
+    }
+
+    const RTSP_HeaderName* header = findHeader(line, valueEnd - line);
+    if (header) {
+      const char* value = line + header->len + 1;
+      while (value < valueEnd && (*value == ' ' || *value == '\t')) value++;
+      const char* trimmed = valueEnd;
+      while (trimmed > value && (trimmed[-1] == ' ' || trimmed[-1] == '\t')) trimmed--;
+      request.headers[header->id].data = value;
+      request.headers[header->id].len = trimmed - value;
+    }
+    line = lineEnd + 1;
+  }
+  const char* body = lineEnd + 1;
+
+  uint32_t value;
+  const RTSP_Span& cseq = request.headers[RTSP_HEADER_CSEQ];
+  if (cseq.len && parseNumber(cseq.data, cseq.len, value)) {
+    request.cseq = (int)value;
+  }
+  const RTSP_Span& session = request.headers[RTSP_HEADER_SESSION];
+  if (session.len && parseNumber(session.data, session.len, value)) { // Ignores ;timeout=
+    request.sessionID = value;
+  }
+  const RTSP_Span& contentLength = request.headers[RTSP_HEADER_CONTENT_LENGTH];
+  bool isTunnel = request.method == RTSP_METHOD_HTTP_POST; // The body is the tunnelled requests, its length is a dummy
+  if (!isTunnel && contentLength.len && parseNumber(contentLength.data, contentLength.len, value)) {
+    if (value > RTSP_BUFFER_SIZE) {
+      return -1;
+    }
+    if ((size_t)(end - body) < value) {
+      return 0;
+    }
+    request.body.data = body;
+    request.body.len = value;
+  }
+  return (body - data) + request.body.len;
+}
+
+/**
+ * @brief Parses the first transport offered in a SETUP Transport header.
+ *
+ * @param value The header value eg. RTP/AVP;unicast;client_port=5000-5001.
+ * @param transport Filled with the lower transport and ports.
+ */
+void RTSPServer::parseTransport(const RTSP_Span& value, RTSP_Transport& transport) {
+  memset(&transport, 0, sizeof(transport));
+  if (value.len == 0) {
+    return;
+  }
+  const char* param = value.data;
+  const char* end = value.data + value.len;
+  const char* comma = (const char*)memchr(param, ',', value.len);
+  if (comma) {
+    end = comma; // Further transports are alternatives
+  }
+
+  while (param < end) {
+    const char* paramEnd = (const char*)memchr(param, ';', end - param);
+    if (paramEnd == NULL) {
+      paramEnd = end;
+    }
+    size_t len = paramEnd - param;
+    uint32_t port;
+    if (startsWith(param, len, "RTP/AVP", 7)) {
+      transport.isAVPF = len > 7 && param[7] == 'F';
+      transport.isTCP = len >= 4 && memcmp(paramEnd - 4, "/TCP", 4) == 0;
+    } else if (len == 9 && memcmp(param, "multicast", 9) == 0) {
+      transport.isMulticast = true;
+    } else if (startsWith(param, len, "client_port=", 12) && parseNumber(param + 12, len - 12, port)) {
+      transport.clientPort = port;
+    } else if (startsWith(param, len, "interleaved=", 12) && parseNumber(param + 12, len - 12, port)) {
+      transport.hasInterleaved = true;
+      transport.interleaved = port;
+    }
+    param = paramEnd + 1;
+  }
+}
+
+/**
+ * @brief Checks if a span holds exactly a string.
+ */
+bool RTSPServer::spanEquals(const RTSP_Span& span, const char* str) const {
+  size_t len = strlen(str);
+  return span.len == len && memcmp(span.data, str, len) == 0;
+}
+
+/**
+ * @brief Checks if a span starts with a string.
+ */
+bool RTSPServer::spanStartsWith(const RTSP_Span& span, const char* str) const {
+  return startsWith(span.data, span.len, str, strlen(str));
+}
@@ -0,0 +1,176 @@
+#include "ESP32-RTSPServer.h"
+
+#define HISTORY_ENTRY_HEADER 4 // Sequence number and length of the stored packet
+
+/**
+ * @brief Reads the sequence number and length of a history entry as one value.
+ *
+ * The entry is written by the video sender while rtspTask reads it.
+ */
+static uint32_t loadEntryHeader(const uint8_t* entry) {
+  const volatile uint8_t* header = entry;
+  return (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+}
+
+/**
+ * @brief Writes the sequence number and length of a history entry, a length of 0 marks it invalid.
+ */
+static void storeEntryHeader(uint8_t* entry, uint16_t sequenceNumber, size_t len) {
+  volatile uint8_t* header = entry;
+  header[0] = (sequenceNumber >> 8) & 0xFF;
+  header[1] = sequenceNumber & 0xFF;
+  header[2] = (len >> 8) & 0xFF;
+  header[3] = len & 0xFF;
+}
+
+/**
+ * @brief Allocates the packet history of a track so NACKed packets can be resent.
+ *
+ * The history holds the last RTSP_NACK_HISTORY packets in PSRAM, indexed by
+ * sequence number, and one more slot that retransmitPacket copies entries to.
+ *
+ * @return true if the history is available.
+ */
+bool RTSPServer::startHistory(RTP_TrackState& track) {
+  if (track.history != NULL) {
+    return true;
+  }
+  if (!psramFound()) {
+    RTSP_LOGW(LOG_TAG, "NACK retransmission needs PSRAM");
+    return false;
+  }
+  track.historySlot = HISTORY_ENTRY_HEADER + RTP_HEADER_SIZE + udpMaxPayload();
+  track.history = (uint8_t*)ps_malloc((size_t)track.historySlot * (RTSP_NACK_HISTORY + 1));
+  if (track.history == NULL) {
+    RTSP_LOGE(LOG_TAG, "Failed to allocate NACK history");
+    return false;
+  }
+  memset(track.history, 0, (size_t)track.historySlot * (RTSP_NACK_HISTORY + 1));
+  return true;
+}
+
+/**
+ * @brief Frees the packet history of a track.
+ */
+void RTSPServer::freeHistory(RTP_TrackState& track) {
+  free(track.history);
+  track.history = NULL;
+}
+
+/**
+ * @brief Copies a sent packet into the history.
+ *
+ * The entry is marked invalid before the packet is copied and gets its header
+ * last, so retransmitPacket never takes a half written entry as complete.
+ *
+ * @param track The track the packet was sent on.
+ * @param sequenceNumber Sequence number of the packet.
+ * @param iov The packet as sent over UDP, without the interleaved prefix.
+ * @param iovcnt Number of segments.
+ */
+void RTSPServer::storeHistory(RTP_TrackState& track, uint16_t sequenceNumber, const struct iovec* iov, int iovcnt) {
+  uint8_t* entry = track.history + (size_t)(sequenceNumber % RTSP_NACK_HISTORY) * track.historySlot;
+  storeEntryHeader(entry, sequenceNumber, 0);
+  std::atomic_thread_fence(std::memory_order_release);
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (HISTORY_ENTRY_HEADER + len + iov[i].iov_len > track.historySlot) {
+      return; // Does not fit, never resent
+    }
+    if (iov[i].iov_len == 0) {
+      continue; // Eg. no header extension, its base may be NULL
+    }
+    memcpy(entry + HISTORY_ENTRY_HEADER + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  storeEntryHeader(entry, sequenceNumber, len);
+}
+
+/**
+ * @brief Handles the FCI entries of an RFC 4585 generic NACK.
+ *
+ * @param ssrc The media SSRC the NACK is about.
+ * @param fci The FCI entries, packet ID and bitmask of following lost packets.
+ * @param len Length of the FCI entries.
+ */
+void RTSPServer::handleNack(uint32_t ssrc, const uint8_t* fci, size_t len) {
+  RTSP_Session* session = NULL;
+  for (RTSP_Session& candidate : this->sessions) {
+    if (candidate.inUse && candidate.videoTrack.ssrc == ssrc && candidate.videoTrack.history != NULL) {
+      session = &candidate;
+      break;
+    }
+  }
+  if (session == NULL) {
+    return;
+  }
+
+  for (; len >= 4; fci += 4, len -= 4) {
+    uint16_t pid = (fci[0] << 8) | fci[1];
+    uint16_t blp = (fci[2] << 8) | fci[3];
+    retransmitPacket(*session, pid);
+    for (int i = 0; i < 16; i++) {
+      if (blp & (1 << i)) {
+        retransmitPacket(*session, pid + i + 1);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Resends a video packet from the history as RFC 4588 RTX.
+ *
+ * The RTX packet has its own SSRC and sequence numbers and carries the
+ * original sequence number in front of the original payload. The video sender
+ * may overwrite the entry meanwhile, so it is copied and only resent if its
+ * header did not change during the copy.
+ */
+void RTSPServer::retransmitPacket(RTSP_Session& session, uint16_t sequenceNumber) {
+  RTP_TrackState& track = session.videoTrack;
+  const uint8_t* entry = track.history + (size_t)(sequenceNumber % RTSP_NACK_HISTORY) * track.historySlot;
+  uint32_t stored = loadEntryHeader(entry);
+  size_t len = stored & 0xFFFF;
+  if ((stored >> 16) != sequenceNumber || len < RTP_HEADER_SIZE) {
+    RTSP_LOGD(LOG_TAG, "NACKed packet %u no longer in history", sequenceNumber);
+    return;
+  }
+  uint8_t* packet = track.history + (size_t)RTSP_NACK_HISTORY * track.historySlot; // Only rtspTask resends
+  std::atomic_thread_fence(std::memory_order_acquire);
+  memcpy(packet, entry + HISTORY_ENTRY_HEADER, len);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (loadEntryHeader(entry) != stored) {
+    RTSP_LOGD(LOG_TAG, "NACKed packet %u was overwritten while resending", sequenceNumber);
+    return;
+  }
+
+  uint8_t header[RTP_HEADER_SIZE + 2];
+  memcpy(header, packet, RTP_HEADER_SIZE);
+  header[1] = (packet[1] & 0x80) | RTP_RTX_PAYLOAD_TYPE; // Keep the marker bit
+  header[2] = (track.rtxSequence >> 8) & 0xFF;
+  header[3] = track.rtxSequence & 0xFF;
+  header[8] = (track.rtxSsrc >> 24) & 0xFF;
+  header[9] = (track.rtxSsrc >> 16) & 0xFF;
+  header[10] = (track.rtxSsrc >> 8) & 0xFF;
+  header[11] = track.rtxSsrc & 0xFF;
+  header[12] = (sequenceNumber >> 8) & 0xFF; // Original sequence number
+  header[13] = sequenceNumber & 0xFF;
+  track.rtxSequence++;
+
+  if (track.rtpAddr.sin_port == 0) {
+    return;
+  }
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = packet + RTP_HEADER_SIZE;
+  iov[1].iov_len = len - RTP_HEADER_SIZE;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &track.rtpAddr;
+  msg.msg_namelen = sizeof(track.rtpAddr);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  sendmsg(this->videoUnicastSocket, &msg, 0);
+}